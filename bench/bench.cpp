@@ -0,0 +1,635 @@
+// sessions_bench - latency, throughput and allocations of the environment, arguments and path utilities.
+// Results are printed as JSON lines, one per benchmark and input size:
+//
+//   {"benchmark":"env/find","size":1000,"iterations":...,"ns_per_op":...,"ops_per_sec":...,"allocs_per_op":...}
+//
+// options:
+//   --filter <text>   only run benchmarks whose name contains <text>
+//   --min-time <ms>   minimum measuring time of each benchmark (default 100)
+//   --max-size <n>    largest synthetic environment/list/.env file size (default 100000)
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <locale>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <range/v3/algorithm.hpp>
+#include <range/v3/view/transform.hpp>
+#include <range/v3/view/join.hpp>
+#include <range/v3/range/conversion.hpp>
+
+#include "red/sessions/session.hpp"
+#include "red/sessions/options.hpp"
+#include "../test/alloc_counter.hpp"
+
+#if defined(WIN32)
+#   include <stdlib.h>
+#else
+extern "C" char** environ;
+#endif
+
+using namespace std::literals;
+using std::string; using std::string_view;
+
+namespace {
+
+red::session::environment environment;
+red::session::arguments arguments;
+
+struct options
+{
+    string_view filter;
+    std::chrono::milliseconds min_time{100};
+    std::size_t max_size = 100000;
+} opts;
+
+// keeps the optimizer from discarding results
+volatile std::size_t sink;
+
+template <class T>
+void keep(T const& value) { sink = sink + static_cast<std::size_t>(value); }
+
+bool selected(string_view name)
+{
+    return name.find(opts.filter) != string_view::npos;
+}
+
+// a negative 'allocs' means it couldn't be measured
+void report(string_view name, std::size_t size, std::size_t iterations, double ns, double allocs)
+{
+    char allocs_text[32] = "null";
+    if (allocs >= 0)
+        std::snprintf(allocs_text, sizeof(allocs_text), "%.3f", allocs);
+
+    std::printf("{\"benchmark\":\"%.*s\",\"size\":%zu,\"iterations\":%zu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,\"allocs_per_op\":%s}\n",
+        (int)name.size(), name.data(), size, iterations, ns, ns > 0 ? 1e9 / ns : 0.0, allocs_text);
+    std::fflush(stdout);
+}
+
+// runs 'op' for at least opts.min_time, doubling the iteration count until it does
+template <class Op>
+void measure(string_view name, std::size_t size, Op&& op)
+{
+    if (!selected(name))
+        return;
+
+    using clock = std::chrono::steady_clock;
+    op(); // warm up
+
+    for (std::size_t iterations = 1;; iterations *= 2)
+    {
+        auto const allocs = alloc_count.load();
+        auto const start = clock::now();
+        for (std::size_t i = 0; i < iterations; i++)
+            op();
+        auto const elapsed = clock::now() - start;
+        auto const allocated = alloc_count.load() - allocs;
+
+        if (elapsed >= opts.min_time || iterations >= (std::size_t(1) << 40))
+        {
+            auto const ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+            report(name, size, iterations, ns, double(allocated) / iterations);
+            return;
+        }
+    }
+}
+
+// synthetic data
+
+string make_key(std::size_t i)
+{
+    return "RED_BENCH_VARIABLE_" + std::to_string(i);
+}
+
+string make_list(std::size_t entries)
+{
+    string list;
+    for (std::size_t i = 0; i < entries; i++)
+    {
+        if (i) list += environment.path_separator;
+        list += "/usr/local/lib/bench/entry" + std::to_string(i) + "/bin";
+    }
+    return list;
+}
+
+// powers of 10 from 'first' up to 'last' or --max-size
+std::vector<std::size_t> sizes(std::size_t first, std::size_t last)
+{
+    std::vector<std::size_t> result;
+    for (auto n = first; n <= std::min(last, opts.max_size); n *= 10)
+        result.push_back(n);
+    return result;
+}
+
+/* Replaces the environment with 'count' synthetic variables.
+   On POSIX environ is pointed at the new block, growing it with setenv is quadratic.
+*/
+class synthetic_env
+{
+public:
+    explicit synthetic_env(std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; i++)
+            m_lines.push_back(make_key(i) + "=value_of_variable_" + std::to_string(i));
+
+#if defined(WIN32)
+        for (std::size_t i = 0; i < count; i++)
+            environment[make_key(i)] = "value_of_variable_" + std::to_string(i);
+#else
+        m_saved = environ;
+        for (auto& l : m_lines)
+            m_block.push_back(l.data());
+        m_block.push_back(nullptr);
+        environ = m_block.data();
+#endif
+    }
+
+    ~synthetic_env()
+    {
+#if defined(WIN32)
+        red::session::environment::batch erase;
+        for (std::size_t i = 0; i < m_lines.size(); i++)
+            erase.erase(make_key(i));
+        erase.commit();
+#else
+        environ = m_saved;
+#endif
+    }
+
+    synthetic_env(synthetic_env const&) = delete;
+    synthetic_env& operator=(synthetic_env const&) = delete;
+
+private:
+    std::vector<string> m_lines;
+    std::vector<char*> m_block;
+    char** m_saved = nullptr;
+};
+
+// benchmarks
+
+void bench_environment(std::size_t n)
+{
+    synthetic_env env(n);
+
+    // lookups of the last variable, the worst case for a linear scan
+    auto const key = make_key(n - 1);
+    auto const line = key + "=value_of_variable_" + std::to_string(n - 1);
+
+    measure("env/find", n, [&] { keep(environment.find(key) != environment.end()); });
+    measure("env/find_if", n, [&] {
+        // the generic path, matching narrowed copies of each entry
+        keep(ranges::find_if(environment, [&](string const& l) { return l == line; }) != environment.end());
+    });
+    measure("env/find_missing", n, [&] { keep(environment.find("RED_BENCH_NONESUCH") != environment.end()); });
+    measure("env/contains", n, [&] { keep(environment.contains(key)); });
+    measure("env/try_get", n, [&] { keep(environment.try_get(key)->size()); });
+    measure("env/operator[]", n, [&] { keep(environment[key].value().size()); });
+
+    // more keys than the hot key cache holds, so most lookups miss it and scan
+    std::vector<string> rotating;
+    for (std::size_t i = 0; i < std::min<std::size_t>(n, 256); i++)
+        rotating.push_back(make_key(n - 1 - i));
+    std::size_t next = 0;
+    measure("env/operator[]_rotating", n, [&] { keep(environment[rotating[next++ % rotating.size()]].value().size()); });
+    measure("env/size", n, [&] { keep(environment.size()); });
+
+    measure("env/iterate", n, [&] {
+        for (auto const& l : environment) keep(l.size());
+    });
+    measure("env/iterate_view", n, [&] {
+        for (auto l : environment.view()) keep(l.size());
+    });
+    measure("env/keys_substr", n, [&] {
+        // keys() before it was made of views
+        auto keys = ranges::views::transform(environment, [](string const& l) { return l.substr(0, l.find('=')); });
+        for (auto const& k : keys) keep(k.size());
+    });
+    measure("env/keys", n, [&] {
+        for (auto const& k : environment.keys()) keep(k.size());
+    });
+    measure("env/values", n, [&] {
+        for (auto const& v : environment.values()) keep(v.size());
+    });
+    measure("env/pairs", n, [&] {
+        for (auto const& kv : environment.pairs()) keep(kv.first.size() + kv.second.size());
+    });
+
+    measure("snapshot/build", n, [&] { keep(red::session::environment::snapshot{}.size()); });
+
+    red::session::environment::snapshot const snap;
+    measure("snapshot/find", n, [&] { keep(snap.find(key) != snap.end()); });
+    measure("snapshot/operator[]", n, [&] { keep(snap[key].size()); });
+
+    // case insensitive lookups of the last key, lower cased
+    string lower_key = key;
+    for (auto& c : lower_key)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+    // what ci_char_traits::compare did for each entry, a locale call per char
+    auto locale_equals = [](string_view a, string_view b) {
+        auto const& lc = std::locale::classic();
+        for (std::size_t i = 0; i < a.size(); i++) {
+            if (std::toupper(a[i], lc) != std::toupper(b[i], lc))
+                return false;
+        }
+        return true;
+    };
+    auto ci_scan = [&](auto equals) {
+        for (auto line : snap) {
+            if (line.size() > lower_key.size() && line[lower_key.size()] == '=' && equals(line.substr(0, lower_key.size()), lower_key))
+                return true;
+        }
+        return false;
+    };
+    measure("ci/locale_scan", n, [&] { keep(ci_scan(locale_equals)); });
+    measure("ci/table_scan", n, [&] { keep(ci_scan(red::session::detail::ascii_iequals)); });
+    measure("ci/index_build", n, [&] { keep(red::session::ci_index(snap).snapshot().size()); });
+
+    red::session::ci_index const ci(snap);
+    measure("ci/index_find", n, [&] { keep(ci.find(lower_key) != ci.end()); });
+
+    // the keys sharing all but the last char of the last key, up to 10 of them
+    auto const prefix = string_view(key).substr(0, key.size() - 1);
+    auto const sum_prefixed = [&](auto const& rng) {
+        std::size_t total = 0;
+        for (auto const& var : rng) total += var.value().size();
+        return total;
+    };
+
+    // what with_prefix replaces, a scan of keys() copying each one
+    measure("sorted/keys_scan", n, [&] {
+        std::size_t total = 0;
+        for (auto const& k : environment.keys())
+            total += k.compare(0, prefix.size(), prefix) == 0;
+        keep(total);
+    });
+    measure("sorted/index_build", n, [&] { keep(red::session::key_index(snap).size()); });
+
+    red::session::key_index const sorted(snap);
+    measure("sorted/with_prefix", n, [&] { keep(sum_prefixed(sorted.with_prefix(prefix))); });
+    measure("sorted/range", n, [&] { keep(sorted.range(make_key(1), make_key(2)).size()); });
+    measure("env/with_prefix", n, [&] { keep(sum_prefixed(environment.with_prefix(prefix))); });
+
+    auto const token = environment.token();
+    measure("env/has_changed_since", n, [&] { keep(environment.has_changed_since(token)); });
+
+    // a change, an addition and a removal
+    environment[make_key(0)] = "changed";
+    environment["RED_BENCH_ADDED"] = "added";
+    environment.erase(make_key(n / 2));
+    red::session::environment::snapshot const after;
+
+    measure("snapshot/diff", n, [&] {
+        auto const d = red::session::diff(snap, after);
+        keep(d.added.size() + d.removed.size() + d.changed.size());
+    });
+
+    // what diff replaces, copies of both environments compared with nested loops
+    if (n <= 10000)
+    {
+        measure("snapshot/diff_nested", n, [&] {
+            std::vector<string> const a(snap.begin(), snap.end()), b(after.begin(), after.end());
+            std::size_t changes = 0;
+            for (auto const& x : a)
+                changes += ranges::find(b, x) == b.end();
+            for (auto const& y : b)
+                changes += ranges::find(a, y) == a.end();
+            keep(changes);
+        });
+    }
+
+    // a literal key at the end of the block, looked up as a string_view and as an env_key
+    constexpr auto added = "RED_BENCH_ADDED"sv;
+    measure("key/find_sv", n, [&] { keep(environment.find(added) != environment.end()); });
+    measure("key/find_env_key", n, [&] { keep(environment.find(RED_ENV_KEY("RED_BENCH_ADDED")) != environment.end()); });
+    measure("key/operator[]_sv", n, [&] { keep(environment[added].value().size()); });
+    measure("key/operator[]_env_key", n, [&] { keep(environment[RED_ENV_KEY("RED_BENCH_ADDED")].value().size()); });
+    measure("key/snapshot_sv", n, [&] { keep(after[added].size()); });
+    measure("key/snapshot_env_key", n, [&] { keep(after[RED_ENV_KEY("RED_BENCH_ADDED")].size()); });
+
+    environment.erase("RED_BENCH_ADDED");
+}
+
+void bench_store(std::size_t n)
+{
+    if (!selected("store/"))
+        return;
+
+    synthetic_env env(n);
+    auto const key = make_key(n / 2);
+    environment.enable_store();
+
+    // reader throughput, alone and while a writer keeps changing the environment
+    for (bool writing : {false, true})
+    {
+        auto const readers = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        std::atomic<bool> done{false};
+        std::atomic<std::size_t> reads{0}, writes{0};
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < readers; i++)
+        {
+            threads.emplace_back([&] {
+                std::size_t local = 0;
+                while (!done.load(std::memory_order_relaxed)) {
+                    auto snap = environment.pin();
+                    keep((*snap)[key].size());
+                    local++;
+                }
+                reads += local;
+            });
+        }
+
+        if (writing) {
+            threads.emplace_back([&] {
+                for (std::size_t i = 0; !done.load(std::memory_order_relaxed); i++) {
+                    environment["RED_BENCH_WRITER"] = std::to_string(i);
+                    writes++;
+                }
+            });
+        }
+
+        auto const allocs = alloc_count.load();
+        auto const start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(opts.min_time * 5);
+        done = true;
+        for (auto& t : threads)
+            t.join();
+
+        auto const elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        // the writer's allocations can't be told apart from the readers'
+        auto const total = std::max<std::size_t>(reads.load(), 1);
+        auto const allocated = double(alloc_count.load() - allocs);
+        report(writing ? "store/read_while_writing" : "store/read", n, total,
+            elapsed * readers / total, writing ? -1 : allocated / total);
+
+        if (writing)
+            report("store/write", n, writes.load(), elapsed / std::max<std::size_t>(writes.load(), 1), -1);
+    }
+
+    environment.erase("RED_BENCH_WRITER");
+}
+
+void bench_lists(std::size_t entries)
+{
+    auto const list = make_list(entries);
+    environment["RED_BENCH_LIST"] = list;
+    auto const var = environment["RED_BENCH_LIST"];
+
+    measure("var/split", entries, [&] {
+        for (auto const& p : var.split()) keep(ranges::distance(p));
+    });
+
+    measure("var/split_index", entries, [&] { keep(var.index().size()); });
+
+    // the middle entry, O(n) through split(), O(1) once indexed
+    measure("var/split_nth", entries, [&] {
+        auto split = var.split();
+        keep(ranges::distance(*ranges::next(split.begin(), entries / 2)));
+    });
+    auto const index = var.index();
+    measure("var/split_index_nth", entries, [&] { keep(index[entries / 2].size()); });
+
+    std::vector<string> parts;
+    for (auto const& p : var.split())
+        parts.emplace_back(p.begin(), p.end());
+
+    measure("join_paths", entries, [&] { keep(red::session::join_paths(parts).size()); });
+    measure("join_paths_views", entries, [&] {
+        // join_paths before it computed the size first
+        auto joined = parts | ranges::views::join(environment.path_separator) | ranges::to<string>();
+        keep(joined.size());
+    });
+
+    string buffer;
+    measure("join_paths_into", entries, [&] {
+        buffer.clear();
+        keep(red::session::join_paths_into(buffer, parts).size());
+    });
+
+    environment.erase("RED_BENCH_LIST");
+}
+
+void bench_typed_values()
+{
+    using namespace std::chrono_literals;
+
+    environment["RED_BENCH_THREADS"] = "16";
+    environment["RED_BENCH_TIMEOUT"] = "250ms";
+    auto const n = environment.size();
+
+    // what get<T> replaces, a copy of the variable and a conversion that can throw
+    measure("var/stoi", n, [&] { keep(std::stoi(environment["RED_BENCH_THREADS"].value())); });
+    measure("var/as", n, [&] { keep(environment["RED_BENCH_THREADS"].as(1)); });
+    measure("env/get", n, [&] { keep(environment.get("RED_BENCH_THREADS", 1)); });
+    measure("env/get_duration", n, [&] { keep(environment.get("RED_BENCH_TIMEOUT", 1000ms).count()); });
+
+    // another variable changes before each read, the value is read again but not parsed
+    std::size_t i = 0;
+    measure("env/get_after_change", n, [&] {
+        environment["RED_BENCH_OTHER"] = (i++ & 1) ? "a" : "b";
+        keep(environment.get("RED_BENCH_THREADS", 1));
+    });
+
+    for (auto key : { "RED_BENCH_THREADS", "RED_BENCH_TIMEOUT", "RED_BENCH_OTHER" })
+        environment.erase(key);
+}
+
+// a .env file with 'lines' lines, mixing plain, exported, quoted and escaped values with comments
+string make_env_file(std::size_t lines)
+{
+    string text;
+    for (std::size_t i = 0; i < lines; i++)
+    {
+        auto const key = make_key(i);
+        switch (i % 5)
+        {
+        case 0: text += "# comment " + std::to_string(i) + "\n"; break;
+        case 1: text += key + "=value_of_variable_" + std::to_string(i) + "\n"; break;
+        case 2: text += "export " + key + "=\"quoted value " + std::to_string(i) + "\"\n"; break;
+        case 3: text += key + "='single quoted $" + std::to_string(i) + "' # trailing\n"; break;
+        case 4: text += key + "=\"escaped\\tvalue\\n" + std::to_string(i) + "\"\n"; break;
+        }
+    }
+    return text;
+}
+
+void bench_env_files(std::size_t lines)
+{
+    if (!selected("envfile/"))
+        return;
+
+    auto const text = make_env_file(lines);
+    auto const file = (std::filesystem::temp_directory_path() / "red-sessions-bench.env").string();
+    std::ofstream(file, std::ios::binary) << text;
+
+    // what load_env_file replaces, reading line by line with no quote or escape handling
+    measure("envfile/getline", lines, [&] {
+        std::ifstream in(file, std::ios::binary);
+        red::session::environment::batch changes;
+        for (string line; std::getline(in, line);)
+        {
+            auto const eq = line.find('=');
+            if (line.empty() || line[0] == '#' || eq == string::npos)
+                continue;
+            changes.set(string_view(line).substr(0, eq), string_view(line).substr(eq + 1));
+        }
+        keep(changes.size());
+    });
+
+    measure("envfile/parse", lines, [&] { keep(red::session::parse_env(text).size()); });
+    measure("envfile/load", lines, [&] { keep(red::session::load_env_file(file).size()); });
+    measure("envfile/snapshot", lines, [&] {
+        keep(red::session::environment::snapshot(red::session::load_env_file(file)).size());
+    });
+
+    // growing the environment with setenv is quadratic, keep it to smaller files
+    if (lines <= 10000)
+    {
+        auto const changes = red::session::load_env_file(file);
+        red::session::environment::batch erase;
+        for (std::size_t i = 0; i < lines; i++)
+            erase.erase(make_key(i));
+
+        measure("envfile/commit", lines, [&] {
+            auto copy = changes;
+            copy.commit();
+            auto undo = erase;
+            undo.commit();
+        });
+    }
+
+    std::filesystem::remove(file);
+}
+
+void bench_write_to(std::size_t n)
+{
+    if (!selected("write/"))
+        return;
+
+    synthetic_env env(n);
+#if defined(WIN32)
+    auto const null_device = std::fopen("NUL", "wb");
+    auto const fd = _fileno(null_device);
+#else
+    auto const null_device = std::fopen("/dev/null", "wb");
+    auto const fd = fileno(null_device);
+#endif
+    using format = red::session::environment::format;
+
+    // what write_to replaces, a string per entry written to a FILE
+    measure("write/strings", n, [&] {
+        for (auto const& line : environment)
+        {
+            auto const eq = line.find('=');
+            auto const entry = "export " + line.substr(0, eq) + "='" + line.substr(eq + 1) + "'\n";
+            std::fwrite(entry.data(), 1, entry.size(), null_device);
+        }
+        std::fflush(null_device);
+    });
+
+    measure("write/nul", n, [&] { environment.write_to(fd, format::nul); });
+    measure("write/shell", n, [&] { environment.write_to(fd, format::shell); });
+    measure("write/json", n, [&] { environment.write_to(fd, format::json); });
+
+    std::fclose(null_device);
+}
+
+void bench_find_executable()
+{
+    std::vector<string> dirs;
+    for (auto const& d : environment["PATH"].split())
+        dirs.emplace_back(d.begin(), d.end());
+
+    auto const name = "sh"s;
+
+    // what find_executable replaces, a stat per directory until it's found
+    measure("path/stat_candidates", dirs.size(), [&] {
+        for (auto const& d : dirs) {
+            if (std::filesystem::exists(std::filesystem::path(d) / name))
+                break;
+        }
+    });
+    measure("path/find_executable", dirs.size(), [&] { keep(red::session::find_executable(name).has_value()); });
+    measure("path/find_executable_cold", dirs.size(), [&] {
+        keep(red::session::executable_cache{}.find(name).has_value());
+    });
+    measure("path/find_executables", dirs.size(), [&] {
+        keep(red::session::find_executables({ "sh", "ls", "cat", "env", "red-nonesuch" }).size());
+    });
+}
+
+void bench_arguments()
+{
+    using red::session::option;
+    static constexpr auto parser = red::session::option_parser({
+        { 'v', "verbose" }, { 'q', "quiet" }, { 'o', "output", option::value }, { 'j', "jobs", option::value },
+        { 'I', "include", option::value }, { 0, "color", option::value }, { 'n', "dry-run" }, { 'k', "keep-going" },
+    });
+    std::vector<string_view> const command_line = {
+        "program", "-vv", "--output=build/out", "-j", "8", "-Iinclude", "--color", "always", "--keep-going", "--", "target",
+    };
+
+    measure("args/parse", command_line.size(), [&] {
+        auto opts = parser.parse(command_line, [](string_view p) { keep(p.size()); });
+        keep(opts.get("jobs", 1));
+    });
+
+    measure("args/iterate", arguments.size(), [&] {
+        for (std::size_t i = 0; i < arguments.size(); i++) keep(arguments[i].size());
+    });
+}
+
+} // unnamed namespace
+
+
+int main(int argc, char const* argv[])
+{
+    red::session::arguments::init(argc, argv);
+
+    for (std::size_t i = 1; i < arguments.size(); i++)
+    {
+        auto const arg = arguments[i];
+        auto const has_value = i + 1 < arguments.size();
+
+        if (arg == "--filter" && has_value)
+            opts.filter = arguments[++i];
+        else if (arg == "--min-time" && has_value)
+            opts.min_time = std::chrono::milliseconds(std::stoll(string(arguments[++i])));
+        else if (arg == "--max-size" && has_value)
+            opts.max_size = std::stoull(string(arguments[++i]));
+        else {
+            std::fprintf(stderr, "usage: sessions_bench [--filter text] [--min-time ms] [--max-size n]\n");
+            return 1;
+        }
+    }
+
+    for (auto n : sizes(10, 100000))
+        bench_environment(n);
+
+    for (auto n : sizes(100, 100000))
+        bench_store(n);
+
+    for (auto n : sizes(10, 10000))
+        bench_lists(n);
+
+    bench_typed_values();
+
+    for (auto n : sizes(1000, 100000))
+        bench_env_files(n);
+
+    for (auto n : sizes(10, 100000))
+        bench_write_to(n);
+
+    bench_find_executable();
+    bench_arguments();
+}
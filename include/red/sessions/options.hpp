@@ -0,0 +1,372 @@
+#ifndef RED_SESSIONS_OPTIONS_HPP
+#define RED_SESSIONS_OPTIONS_HPP
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "session.hpp"
+
+namespace red::session {
+
+    // an entry of an option table, options have a short name, a long name or both
+    struct option
+    {
+        enum kind : unsigned char { flag, value };
+
+        char short_name = 0;        // -x, 0 if none
+        std::string_view long_name; // --name, empty if none
+        kind type = flag;           // values are given as --name=value, --name value, -xvalue or -x value
+    };
+
+    // thrown for command lines that don't match the option table
+    class option_error : public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+namespace detail {
+
+    constexpr std::uint32_t option_hash(std::string_view name, std::uint32_t seed) noexcept
+    {
+        std::uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+        for (char c : name) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    constexpr std::size_t option_table_size(std::size_t n) noexcept
+    {
+        std::size_t size = 8;
+        while (size < n * 8)
+            size *= 2;
+        return size;
+    }
+
+} // namespace detail
+
+    template <std::size_t N>
+    class parsed_options;
+
+    /* A command line parser built from a constexpr option table.
+       Long names are matched through a hash table whose seed is searched for at compile time,
+       so with no collisions a lookup is one hash and one compare, short names are a table lookup.
+       Supports -x, bundled short flags (-abc), --name, --name=value and the -- terminator.
+       Parsing makes no allocations, values are string_views into the arguments.
+
+           constexpr auto parser = red::session::option_parser({
+               { 'v', "verbose" },
+               { 'o', "output", red::session::option::value },
+           });
+           auto opts = parser.parse(red::session::arguments{}, [](std::string_view file) { ... });
+    */
+    template <std::size_t N>
+    class option_parser
+    {
+        static_assert(N > 0 && N < 0xffff, "option tables hold 1 to 65534 options");
+
+        static constexpr std::size_t table_size = detail::option_table_size(N);
+
+    public:
+        static constexpr std::size_t npos = std::size_t(-1);
+
+        constexpr option_parser(option const (&options)[N]) : m_options{}, m_short{}, m_long{}, m_seed(0)
+        {
+            for (std::size_t i = 0; i < N; i++)
+                m_options[i] = options[i];
+            build();
+        }
+
+        // a template, so braced lists only match the array constructor
+        template <class Array, std::enable_if_t<std::is_same_v<Array, std::array<option, N>>, bool> = true>
+        constexpr option_parser(Array const& options) : m_options(options), m_short{}, m_long{}, m_seed(0)
+        {
+            build();
+        }
+
+        // index of the option named 'name' or 'c', npos if there's none
+        constexpr std::size_t find(std::string_view name) const noexcept
+        {
+            if (name.empty())
+                return npos;
+
+            for (auto slot = detail::option_hash(name, m_seed) & (table_size - 1); m_long[slot] != 0; slot = (slot + 1) & (table_size - 1))
+            {
+                auto const i = m_long[slot] - 1u;
+                if (m_options[i].long_name == name)
+                    return i;
+            }
+
+            return npos;
+        }
+
+        constexpr std::size_t find(char c) const noexcept
+        {
+            auto const i = m_short[static_cast<unsigned char>(c)];
+            return c != 0 && i != 0 ? i - 1u : npos;
+        }
+
+        constexpr option const& operator [] (std::size_t i) const noexcept { return m_options[i]; }
+
+        constexpr std::size_t size() const noexcept { return N; }
+
+        /* Calls on_option(index, value) for each option in 'args' and on_positional(arg) for each positional argument,
+           the first argument, the program's name, is skipped. Flags are given an empty value.
+           Throws option_error for unknown options and missing or unexpected values.
+        */
+        template <class Rng, class OnOption, class OnPositional>
+        void parse(Rng const& args, OnOption&& on_option, OnPositional&& on_positional) const
+        {
+            auto it = ranges::begin(args);
+            auto const end = ranges::end(args);
+            if (it == end)
+                return;
+
+            bool options_done = false;
+            while (++it != end)
+            {
+                std::string_view const arg = *it;
+
+                if (options_done || arg.size() < 2 || arg[0] != '-') {
+                    on_positional(arg);
+                    continue;
+                }
+
+                if (arg == "--") {
+                    options_done = true;
+                    continue;
+                }
+
+                if (arg[1] == '-')
+                {
+                    auto name = arg.substr(2);
+                    auto const eq = name.find('=');
+                    auto const has_value = eq != std::string_view::npos;
+                    auto const value = has_value ? name.substr(eq + 1) : std::string_view{};
+                    name = name.substr(0, eq);
+
+                    auto const i = find(name);
+                    if (i == npos)
+                        throw option_error("unknown option '" + std::string(arg.substr(0, eq == std::string_view::npos ? eq : eq + 2)) + "'");
+
+                    if (m_options[i].type == option::flag) {
+                        if (has_value)
+                            throw option_error("option '--" + std::string(name) + "' doesn't take a value");
+                        on_option(i, std::string_view{});
+                    }
+                    else if (has_value)
+                        on_option(i, value);
+                    else if (++it != end)
+                        on_option(i, std::string_view(*it));
+                    else
+                        throw option_error("option '--" + std::string(name) + "' requires a value");
+
+                    continue;
+                }
+
+                // bundled short options, a value option takes the rest of the bundle or the next argument
+                for (std::size_t c = 1; c < arg.size(); c++)
+                {
+                    auto const i = find(arg[c]);
+                    if (i == npos)
+                        throw option_error("unknown option '-" + std::string(1, arg[c]) + "'");
+
+                    if (m_options[i].type == option::flag) {
+                        on_option(i, std::string_view{});
+                        continue;
+                    }
+
+                    if (c + 1 < arg.size())
+                        on_option(i, arg.substr(c + 1));
+                    else if (++it != end)
+                        on_option(i, std::string_view(*it));
+                    else
+                        throw option_error("option '-" + std::string(1, arg[c]) + "' requires a value");
+                    break;
+                }
+            }
+        }
+
+        // collects the options in 'args', positional arguments are passed to 'on_positional'
+        template <class Rng, class OnPositional>
+        parsed_options<N> parse(Rng const& args, OnPositional&& on_positional) const
+        {
+            parsed_options<N> result{ *this };
+            parse(args, [&result](std::size_t i, std::string_view value) { result.add(i, value); }, on_positional);
+            return result;
+        }
+
+        // throws option_error for positional arguments
+        template <class Rng>
+        parsed_options<N> parse(Rng const& args) const
+        {
+            return parse(args, [](std::string_view arg) {
+                throw option_error("unexpected argument '" + std::string(arg) + "'");
+            });
+        }
+
+    private:
+        constexpr void build()
+        {
+            for (std::size_t i = 0; i < N; i++)
+            {
+                auto const c = static_cast<unsigned char>(m_options[i].short_name);
+                if (c != 0) {
+                    if (m_short[c] != 0)
+                        throw std::invalid_argument("duplicate short option name");
+                    m_short[c] = static_cast<std::uint16_t>(i + 1);
+                }
+
+                for (std::size_t j = 0; j < i; j++) {
+                    if (!m_options[i].long_name.empty() && m_options[i].long_name == m_options[j].long_name)
+                        throw std::invalid_argument("duplicate long option name");
+                }
+            }
+
+            // look for a seed that puts every long name in its own slot, collisions are probed linearly
+            // if none is found, the table is at most 1/8 full so probes stay short
+            for (std::uint32_t seed = 0; seed < 256; seed++)
+            {
+                m_seed = seed;
+                if (fill_long())
+                    return;
+            }
+
+            m_seed = 0;
+            fill_long();
+        }
+
+        // true if there were no collisions
+        constexpr bool fill_long()
+        {
+            bool perfect = true;
+            for (auto& slot : m_long)
+                slot = 0;
+
+            for (std::size_t i = 0; i < N; i++)
+            {
+                if (m_options[i].long_name.empty())
+                    continue;
+
+                auto slot = detail::option_hash(m_options[i].long_name, m_seed) & (table_size - 1);
+                for (; m_long[slot] != 0; slot = (slot + 1) & (table_size - 1))
+                    perfect = false;
+
+                m_long[slot] = static_cast<std::uint16_t>(i + 1);
+            }
+
+            return perfect;
+        }
+
+        std::array<option, N> m_options;
+        std::array<std::uint16_t, 256> m_short; // 1 based indexes into m_options, 0 when empty
+        std::array<std::uint16_t, table_size> m_long;
+        std::uint32_t m_seed;
+    };
+
+    template <std::size_t N>
+    option_parser(option const (&)[N]) -> option_parser<N>;
+
+    template <std::size_t N>
+    option_parser(std::array<option, N> const&) -> option_parser<N>;
+
+
+    /* The options found by option_parser::parse, looked up by long or short name.
+       It holds a copy of the parser, so it can outlive it, e.g. one built in the same expression.
+       Values are views into the parsed arguments, the last occurrence of an option wins.
+       Names missing from the option table throw std::invalid_argument.
+    */
+    template <std::size_t N>
+    class parsed_options
+    {
+    public:
+        explicit parsed_options(option_parser<N> const& parser) noexcept : m_parser(parser) {}
+
+        template <class Name>
+        std::size_t count(Name const& name) const { return m_counts[index(name)]; }
+
+        template <class Name>
+        bool has(Name const& name) const { return count(name) != 0; }
+
+        template <class Name>
+        std::optional<std::string_view> value(Name const& name) const
+        {
+            auto const i = index(name);
+            return m_counts[i] ? std::optional<std::string_view>(m_values[i]) : std::nullopt;
+        }
+
+        /* The value converted to T, see value_traits. Flags are converted to bool, true if they were given.
+           Throws option_error if the value can't be converted.
+        */
+        template <class T, class Name>
+        std::optional<T> get(Name const& name) const
+        {
+            auto const i = index(name);
+            if constexpr (std::is_same_v<T, bool>) {
+                if (m_parser[i].type == option::flag)
+                    return m_counts[i] != 0;
+            }
+
+            if (!m_counts[i])
+                return std::nullopt;
+
+            if (auto result = value_traits<T>::parse(m_values[i]))
+                return result;
+
+            throw option_error("invalid value '" + std::string(m_values[i]) + "' for option '" + describe(i) + "'");
+        }
+
+        template <class T, class Name>
+        T get(Name const& name, T const& default_value) const
+        {
+            return get<T>(name).value_or(default_value);
+        }
+
+    private:
+        friend class option_parser<N>;
+
+        void add(std::size_t i, std::string_view value) noexcept
+        {
+            m_counts[i]++;
+            m_values[i] = value;
+        }
+
+        std::size_t index(std::string_view name) const
+        {
+            auto const i = m_parser.find(name);
+            if (i == option_parser<N>::npos)
+                throw std::invalid_argument("'" + std::string(name) + "' is not in the option table");
+            return i;
+        }
+
+        std::size_t index(char const* name) const { return index(std::string_view(name)); }
+
+        std::size_t index(char name) const
+        {
+            auto const i = m_parser.find(name);
+            if (i == option_parser<N>::npos)
+                throw std::invalid_argument("'" + std::string(1, name) + "' is not in the option table");
+            return i;
+        }
+
+        std::string describe(std::size_t i) const
+        {
+            auto const& opt = m_parser[i];
+            return opt.long_name.empty() ? "-" + std::string(1, opt.short_name) : "--" + std::string(opt.long_name);
+        }
+
+        option_parser<N> m_parser;
+        std::array<std::uint32_t, N> m_counts{};
+        std::array<std::string_view, N> m_values{};
+    };
+
+} /* namespace red::session */
+
+#endif /* RED_SESSIONS_OPTIONS_HPP */
@@ -4,6 +4,17 @@
 #include <type_traits>
 #include <string_view>
 #include <string>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+#include <array>
+#include <charconv>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <memory_resource>
+#include <cstdint>
+#include <chrono>
 
 #include <range/v3/view/split.hpp>
 #include <range/v3/view/join.hpp>
@@ -33,12 +44,33 @@ namespace meta
     using is_strview_convertible = test_t<
         std::is_convertible_v<const T&, std::string_view>
     >;
+
+    // T::native() is a narrow string, like std::filesystem::path on POSIX
+    template <class T, class = void>
+    struct has_narrow_native : std::false_type {};
+    template <class T>
+    struct has_narrow_native<T, std::void_t<decltype(std::string_view(std::declval<T const&>().native()))>> : std::true_type {};
+
+    template <class T, class = void>
+    struct has_narrow_string : std::false_type {};
+    template <class T>
+    struct has_narrow_string<T, std::void_t<decltype(std::string(std::declval<T const&>().string()))>> : std::true_type {};
+
+    // what join_paths accepts: strings and std::filesystem::paths
+    template <class T>
+    constexpr bool is_path_like =
+        std::is_convertible_v<T const&, std::string_view> || has_narrow_native<T>::value || has_narrow_string<T>::value;
+
+    template <class T>
+    constexpr bool is_separator = std::is_same_v<T, char> || std::is_convertible_v<T const&, std::string_view>;
 }
 
 // impl detail
 namespace detail {
 
     std::string narrow_copy(envchar const* s);
+    // narrow_copy allocating from 'mr'
+    std::pmr::string pmr_narrow_copy(envchar const* s, std::pmr::memory_resource* mr);
 
     // cursor over an array of pointers where the end is nullptr
     template<typename T>
@@ -48,6 +80,7 @@ namespace detail {
     public:
         void next() noexcept { block++; }
         void prev() noexcept { block--; }
+        void advance(std::ptrdiff_t n) noexcept { block += n; }
         T* read() const noexcept { return *block; };
         std::ptrdiff_t distance_to(ptr_array_cursor const &that) const noexcept {
             return that.block - block;
@@ -77,27 +110,409 @@ namespace detail {
     };
 
 
+    // cursor that reads entries in place, without copying them
+    struct view_cursor : env_cursor
+    {
+        using env_cursor::env_cursor;
+        using value_type = std::basic_string_view<envchar>;
+
+        value_type read() const noexcept {
+            return env_cursor::read();
+        }
+    };
+
+    // entries of each of environment::get's per thread caches, a power of 2
+    constexpr std::size_t typed_cache_size = 16;
+
+    // FNV-1a hash of an environment key
+    constexpr std::size_t hash_key(std::string_view key) noexcept
+    {
+        std::uint64_t h = 14695981039346656037ull;
+        for (char c : key) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 1099511628211ull;
+        }
+        return static_cast<std::size_t>(h);
+    }
+
+    // fingerprint of an environment block, see environment::token(), default constructed ones match no block
+    struct env_token
+    {
+        void const* block = nullptr;
+        std::size_t count = 0;
+        std::uint64_t hash = 0; // of the entry pointers
+
+        friend bool operator== (env_token const& a, env_token const& b) noexcept {
+            return a.block == b.block && a.count == b.count && a.hash == b.hash;
+        }
+        friend bool operator!= (env_token const& a, env_token const& b) noexcept { return !(a == b); }
+    };
+
+    // immutable copy of an environment block, entries are stored back to back in 'arena'
+    // and indexed by an open addressing hash table
+    struct env_table
+    {
+        struct slot
+        {
+            std::uint32_t hash;
+            std::uint32_t index; // 1 based index into 'lines', 0 marks an empty slot
+        };
+
+        explicit env_table(std::pmr::memory_resource* mr) : arena(mr), lines(mr), slots(mr) {}
+
+        std::pmr::string arena;
+        std::pmr::vector<std::string_view> lines;
+        std::pmr::vector<slot> slots;
+        env_token token; // of the block it was copied from
+    };
+
+
+    struct reader_slot;
+
+
+    /* A key and its value stored back to back as "key\0value\0", short ones are kept inline.
+       Keys with static storage (env_key's) can be borrowed instead, then only "value\0" is stored.
+    */
+    class kv_buffer
+    {
+    public:
+        static constexpr std::size_t inline_size = 64;
+
+        struct borrowed_key_t {};
+        static constexpr borrowed_key_t borrowed_key{};
+
+        kv_buffer(std::string_view key, std::string_view value);
+        // 'key' must be null terminated and outlive the buffer
+        kv_buffer(borrowed_key_t, std::string_view key, std::string_view value);
+        kv_buffer(kv_buffer const& other) : m_borrowed(other.m_borrowed), m_key_size(other.m_key_size) { store(other.key(), other.value()); }
+        kv_buffer(kv_buffer&& other) noexcept;
+        kv_buffer& operator=(kv_buffer other) noexcept;
+        ~kv_buffer() { delete[] m_heap; }
+
+        std::string_view key() const noexcept { return { key_c_str(), m_key_size }; }
+        std::string_view value() const noexcept { return { value_c_str(), m_value_size }; }
+
+        // both are null terminated
+        char const* key_c_str() const noexcept { return m_borrowed ? m_borrowed : data(); }
+        char const* value_c_str() const noexcept { return data() + value_offset(); }
+
+        void assign_value(std::string_view value);
+
+    private:
+        char const* data() const noexcept { return m_heap ? m_heap : m_inline; }
+        std::size_t value_offset() const noexcept { return m_borrowed ? 0 : m_key_size + 1; }
+        std::size_t stored_size() const noexcept { return value_offset() + m_value_size + 1; }
+
+        // copies what isn't borrowed, the key sizes must be set
+        void store(std::string_view key, std::string_view value);
+
+        char* m_heap = nullptr;
+        char const* m_borrowed = nullptr;
+        std::size_t m_key_size = 0, m_value_size = 0;
+        char m_inline[inline_size];
+    };
+
+
+    // str.substr(pos, n), strings are copied with their allocator
+    template <class Str>
+    Str substring(Str const& str, std::size_t pos, std::size_t n = Str::npos)
+    {
+        if constexpr (std::is_same_v<Str, std::basic_string_view<typename Str::value_type, typename Str::traits_type>>)
+            return str.substr(pos, n);
+        else
+            return Str(str, pos, n, str.get_allocator());
+    }
+
+    // takes the key or value of a key=value line, views stay views, strings are copied
     struct keyval_fn
     {
         explicit keyval_fn(bool key) : getkey(key) {}
 
-        auto operator() (std::string const& line) const noexcept
+        template <class Str>
+        Str operator() (Str const& line) const
         {
             auto const eq = line.find('=');
-            return getkey ? line.substr(0, eq) : line.substr(eq+1);
+            return getkey ? substring(line, 0, eq) : substring(line, eq+1);
         }
 
     private:
         bool getkey;
     };
+
+    // splits a key=value line at the first '='
+    struct keyval_pair_fn
+    {
+        template <class Str>
+        std::pair<Str, Str> operator() (Str const& line) const
+        {
+            auto const eq = line.find('=');
+            if (eq == Str::npos)
+                return { line, substring(line, line.size()) };
+
+            return { substring(line, 0, eq), substring(line, eq+1) };
+        }
+    };
+
+    // a-z folded to A-Z, other bytes are left alone, like toupper in the "C" locale
+    inline constexpr auto ascii_upper_table = [] {
+        std::array<unsigned char, 256> table{};
+        for (unsigned c = 0; c < 256; c++)
+            table[c] = static_cast<unsigned char>(c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c);
+        return table;
+    }();
+
+    constexpr char ascii_upper(char c) noexcept {
+        return static_cast<char>(ascii_upper_table[static_cast<unsigned char>(c)]);
+    }
+
+    constexpr bool ascii_iequals(std::string_view a, std::string_view b) noexcept
+    {
+        if (a.size() != b.size())
+            return false;
+        for (std::size_t i = 0; i < a.size(); i++) {
+            if (ascii_upper(a[i]) != ascii_upper(b[i]))
+                return false;
+        }
+        return true;
+    }
+
+    // hash_key of the folded key
+    constexpr std::size_t hash_key_ci(std::string_view key) noexcept
+    {
+        std::uint64_t h = 14695981039346656037ull;
+        for (char c : key) {
+            h ^= ascii_upper_table[static_cast<unsigned char>(c)];
+            h *= 1099511628211ull;
+        }
+        return static_cast<std::size_t>(h);
+    }
+
+    // changes whenever the environment is changed through the library
+    std::uint64_t env_generation() noexcept;
     
 
 } // namespace detail
 
+    /* Specialize with a table of names to parse an enum by name, names are matched ignoring ASCII case.
+
+           template <> struct red::session::enum_names<level> {
+               static constexpr std::pair<std::string_view, level> values[] = { {"low", level::low}, {"high", level::high} };
+           };
+
+       Enums without one are parsed from their underlying integer.
+    */
+    template <class E>
+    struct enum_names {};
+
+    /* How environment::get, variable::as and option values are parsed, specialize it to parse your own types.
+       parse() returns nullopt for text that isn't a T. Numbers are parsed with std::from_chars,
+       bools from true/false, 1/0, yes/no and on/off, ignoring case, durations are a count followed
+       by an optional unit (ns, us, ms, s, m or min, h), which is the duration's own when missing,
+       and must fit the duration's precision.
+    */
+    template <class T, class = void>
+    struct value_traits {};
+
+    template <>
+    struct value_traits<std::string_view>
+    {
+        static std::optional<std::string_view> parse(std::string_view text) noexcept { return text; }
+    };
+
+    template <>
+    struct value_traits<std::string>
+    {
+        static std::optional<std::string> parse(std::string_view text) { return std::string(text); }
+    };
+
+    template <>
+    struct value_traits<bool>
+    {
+        static std::optional<bool> parse(std::string_view text) noexcept
+        {
+            for (auto word : { "true", "1", "yes", "on" })
+                if (detail::ascii_iequals(text, word)) return true;
+            for (auto word : { "false", "0", "no", "off" })
+                if (detail::ascii_iequals(text, word)) return false;
+            return std::nullopt;
+        }
+    };
+
+    template <class T>
+    struct value_traits<T, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>>
+    {
+        static std::optional<T> parse(std::string_view text) noexcept
+        {
+            T result{};
+            auto const end = text.data() + text.size();
+            auto const [ptr, ec] = std::from_chars(text.data(), end, result);
+            if (ec != std::errc() || ptr != end || text.empty())
+                return std::nullopt;
+            return result;
+        }
+    };
+
+    template <class Rep, class Period>
+    struct value_traits<std::chrono::duration<Rep, Period>>
+    {
+        using duration = std::chrono::duration<Rep, Period>;
+
+        static std::optional<duration> parse(std::string_view text) noexcept
+        {
+            auto split = text.size();
+            while (split > 0 && detail::ascii_upper(text[split - 1]) >= 'A' && detail::ascii_upper(text[split - 1]) <= 'Z')
+                split--;
+
+            auto const count = value_traits<Rep>::parse(text.substr(0, split));
+            if (!count)
+                return std::nullopt;
+
+            // conversions that lose precision, like 1500us to milliseconds, fail
+            auto in = [&](auto unit) -> std::optional<duration> {
+                using given = std::chrono::duration<Rep, decltype(unit)>;
+                auto const result = std::chrono::duration_cast<duration>(given(*count));
+                if (!std::is_floating_point_v<Rep> && std::chrono::duration_cast<given>(result) != given(*count))
+                    return std::nullopt;
+                return result;
+            };
+
+            auto const unit = text.substr(split);
+            if (unit.empty()) return duration(*count);
+            if (unit == "ns") return in(std::nano{});
+            if (unit == "us") return in(std::micro{});
+            if (unit == "ms") return in(std::milli{});
+            if (unit == "s") return in(std::ratio<1>{});
+            if (unit == "m" || unit == "min") return in(std::ratio<60>{});
+            if (unit == "h") return in(std::ratio<3600>{});
+            return std::nullopt;
+        }
+    };
+
+    template <class E>
+    struct value_traits<E, std::enable_if_t<std::is_enum_v<E>>>
+    {
+        template <class U, class = void>
+        struct has_names : std::false_type {};
+        template <class U>
+        struct has_names<U, std::void_t<decltype(enum_names<U>::values)>> : std::true_type {};
+
+        static std::optional<E> parse(std::string_view text) noexcept
+        {
+            if constexpr (has_names<E>::value)
+            {
+                for (auto const& [name, value] : enum_names<E>::values) {
+                    if (detail::ascii_iequals(name, text))
+                        return value;
+                }
+                return std::nullopt;
+            }
+            else
+            {
+                auto const n = value_traits<std::underlying_type_t<E>>::parse(text);
+                return n ? std::optional<E>(static_cast<E>(*n)) : std::nullopt;
+            }
+        }
+    };
+
+    namespace detail {
+        // marks an env_key with static storage duration, only RED_ENV_KEY builds those
+        struct static_key_t {};
+        static constexpr static_key_t static_key{};
+    }
+
+    /* A key known at compile time, with its length and hash computed once, see RED_ENV_KEY.
+       Lookups through environment::operator[], find(), contains() and snapshot lookups use the
+       stored hash instead of hashing the key again. It's null terminated and converts to std::string_view,
+       so it can be used wherever a key is expected.
+       The keys of RED_ENV_KEY have static storage, environment lookups keep a reference to them in the
+       hot key cache and in variables instead of copying them. Other env_keys are copied like string keys.
+       Throws std::invalid_argument if the key is empty or contains '=' or a null char,
+       which makes keys built at compile time fail to compile.
+    */
+    template <std::size_t N>
+    class env_key
+    {
+        static_assert(N > 1, "environment keys can't be empty");
+
+    public:
+        constexpr env_key(char const (&key)[N]) : m_key{}, m_hash(detail::hash_key({ key, N - 1 }))
+        {
+            for (std::size_t i = 0; i < N - 1; i++) {
+                if (key[i] == '=' || key[i] == '\0')
+                    throw std::invalid_argument("environment keys can't contain '=' or null chars");
+                m_key[i] = key[i];
+            }
+            if (key[N - 1] != '\0')
+                throw std::invalid_argument("environment keys must be null terminated");
+        }
+
+        // used by RED_ENV_KEY for its static object, whose key lookups may borrow
+        constexpr env_key(detail::static_key_t, char const (&key)[N]) : env_key(key) { m_static = true; }
+
+        constexpr std::string_view str() const noexcept { return { m_key, N - 1 }; }
+        constexpr operator std::string_view() const noexcept { return str(); }
+        constexpr char const* c_str() const noexcept { return m_key; }
+
+        constexpr std::size_t size() const noexcept { return N - 1; }
+
+        // detail::hash_key of the key
+        constexpr std::size_t hash() const noexcept { return m_hash; }
+
+        // true if the key outlives any lookup, see RED_ENV_KEY
+        constexpr bool is_static() const noexcept { return m_static; }
+
+    private:
+        char m_key[N];
+        std::size_t m_hash;
+        bool m_static = false;
+    };
+
+    // a reference to a static env_key, built and checked at compile time: environment[RED_ENV_KEY("PATH")]
+#define RED_ENV_KEY(key) \
+    ([]() noexcept -> auto const& { \
+        static constexpr ::red::session::env_key<sizeof(key)> k{ ::red::session::detail::static_key, key }; return k; }())
+
+    class split_index;
+    class key_index;
+
+    /* A view over the environment's entries that doesn't copy them, each entry is a
+       std::basic_string_view<envchar> pointing into the environment block (a std::string_view on POSIX).
+       Entries are invalidated by changes to the environment.
+    */
+    class environment_view : public ranges::basic_view<ranges::finite>
+    {
+        using cursor = detail::view_cursor;
+        cursor begin_cursor() const noexcept;
+
+    public:
+        using iterator = ranges::basic_iterator<cursor>;
+        using value_type = std::basic_string_view<detail::envchar>;
+        using size_type = std::size_t;
+
+        auto begin() const noexcept {
+            return iterator(begin_cursor());
+        }
+        auto cbegin() const noexcept { return begin(); }
+
+        auto end() const noexcept {
+            return ranges::default_sentinel;
+        }
+        auto cend() const noexcept { return end(); }
+
+        size_type size () const noexcept;
+
+        [[nodiscard]]
+        bool empty() const noexcept { return size() == 0; }
+    };
+
+    static_assert(ranges::bidirectional_range<environment_view>, "environment_view is a bidirectional range.");
+
+
     class environment : public ranges::basic_view<ranges::finite>
     {
         using cursor = detail::narrowing_cursor;
         cursor begin_cursor() const;
+        cursor end_cursor() const noexcept;
 
     public:
         // the separator char. used in the PATH variable
@@ -108,56 +523,316 @@ namespace detail {
         public:
             friend class environment;
         
-            std::string_view key() const noexcept { return m_key; }
-            std::string_view value() const & noexcept { return m_value; }
-            std::string value() const && noexcept { return m_value; }
-            operator std::string() const { return m_value; }
+            std::string_view key() const noexcept { return m_data.key(); }
+            std::string_view value() const & noexcept { return m_data.value(); }
+            std::string value() const && noexcept { return std::string(m_data.value()); }
+            operator std::string() const { return std::string(m_data.value()); }
 
             auto split (char sep = environment::path_separator) const
             {
                 using namespace ranges;
-                return m_value | views::split(sep);
+                return value() | views::split(sep);
             }
 
+            // indexed split of the value, see split_index
+            split_index index(char sep = environment::path_separator) const &;
+            split_index index(char sep = environment::path_separator) const && = delete;
+
+            // the value parsed as T, nullopt if it can't be, see value_traits
+            template <class T>
+            std::optional<T> as() const { return value_traits<T>::parse(value()); }
+
+            template <class T>
+            T as(T const& default_value) const { return as<T>().value_or(default_value); }
+
             variable& operator=(std::string_view value);
 
         private:
             explicit variable(std::string_view key_);
+            // 'hash' is detail::hash_key(key_)
+            variable(std::string_view key_, std::size_t hash);
+            // borrows the key of a static env_key
+            variable(detail::kv_buffer::borrowed_key_t, std::string_view key_, std::size_t hash);
+
+            // key and value share a single buffer, short ones make no allocations
+            detail::kv_buffer m_data;
+        };
+
+        /* Like variable, but borrows its key and value instead of copying them, it makes no allocations.
+           It's only valid while what it borrows from is, e.g. the snapshot it came from.
+        */
+        class variable_ref
+        {
+        public:
+            variable_ref() = default;
+            variable_ref(std::string_view key, std::string_view value) noexcept : m_key(key), m_value(value) {}
+
+            std::string_view key() const noexcept { return m_key; }
+            std::string_view value() const noexcept { return m_value; }
+            operator std::string_view() const noexcept { return m_value; }
+            explicit operator std::string() const { return std::string(m_value); }
+
+            auto split (char sep = environment::path_separator) const
+            {
+                using namespace ranges;
+                return m_value | views::split(sep);
+            }
+
+            split_index index(char sep = environment::path_separator) const;
+
+            template <class T>
+            std::optional<T> as() const { return value_traits<T>::parse(m_value); }
+
+            template <class T>
+            T as(T const& default_value) const { return as<T>().value_or(default_value); }
+
+        private:
+            std::string_view m_key, m_value;
+        };
+
+        class batch;
+
+        /* Fingerprint of the environment block: its address, entry count and a hash of its entry pointers.
+           Taking one is O(n) but reads no strings, see has_changed_since().
+        */
+        using change_token = detail::env_token;
+
+        /* An immutable copy of the environment, taken at the time it's constructed.
+           Lookups are O(1) and return views into the snapshot, copies share the same storage,
+           so it can be freely read from multiple threads.
+        */
+        class snapshot
+        {
+        public:
+            using value_type = std::string_view;
+            using iterator = std::pmr::vector<std::string_view>::const_iterator;
+            using size_type = std::size_t;
 
-            std::string m_key, m_value;
+            snapshot();
+
+            /* All of the snapshot's storage, including what its copies share, is allocated from 'mr',
+               which must outlive the snapshot and its copies.
+            */
+            explicit snapshot(std::pmr::memory_resource* mr);
+
+            /* Only the variables set by 'changes', sorted by key, the environment isn't read or changed.
+               Throws std::invalid_argument if 'changes' has invalid keys, see environment::batch::commit
+            */
+            explicit snapshot(batch const& changes, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+            iterator find(std::string_view key) const noexcept;
+
+            bool contains(std::string_view key) const noexcept { return find(key) != end(); }
+
+            // value of 'key', empty if it's not set
+            std::string_view operator [] (std::string_view key) const noexcept;
+
+            // 'key' and its value, borrowed from the snapshot
+            variable_ref ref(std::string_view key) const noexcept { return { key, (*this)[key] }; }
+
+            // lookups with the key's stored hash
+            template <std::size_t N>
+            iterator find(env_key<N> const& key) const noexcept { return find(key.str(), key.hash()); }
+
+            template <std::size_t N>
+            bool contains(env_key<N> const& key) const noexcept { return find(key) != end(); }
+
+            template <std::size_t N>
+            std::string_view operator [] (env_key<N> const& key) const noexcept
+            {
+                auto it = find(key);
+                return it != end() ? it->substr(N) : std::string_view{};
+            }
+
+            iterator begin() const noexcept { return m_table->lines.begin(); }
+            iterator cbegin() const noexcept { return begin(); }
+            iterator end() const noexcept { return m_table->lines.end(); }
+            iterator cend() const noexcept { return end(); }
+
+            size_type size() const noexcept { return m_table->lines.size(); }
+
+            [[nodiscard]]
+            bool empty() const noexcept { return size() == 0; }
+
+            // the environment's token when the snapshot was taken, snapshots of a batch have one that never matches
+            change_token token() const noexcept { return m_table->token; }
+
+        private:
+            // 'hash' is detail::hash_key(key)
+            iterator find(std::string_view key, std::size_t hash) const noexcept;
+
+            std::shared_ptr<const detail::env_table> m_table;
+        };
+
+        /* Guard that keeps the concurrent store's current snapshot alive, see environment::pin().
+           A pinned snapshot is never reclaimed, copy it if you need it after the guard is gone.
+        */
+        class pinned
+        {
+        public:
+            pinned(pinned const&) = delete;
+            pinned& operator=(pinned const&) = delete;
+            ~pinned();
+
+            snapshot const& operator* () const noexcept { return *m_snap; }
+            snapshot const* operator-> () const noexcept { return m_snap; }
+
+        private:
+            friend class environment;
+            pinned(detail::reader_slot* slot) noexcept;
+
+            detail::reader_slot* m_slot;
+            snapshot const* m_snap;
+        };
+
+        /* Collects changes to the environment and applies them at once with commit().
+           Keys and values are kept null terminated in a single buffer, so applying them makes no copies.
+        */
+        class batch
+        {
+        public:
+            batch& set(std::string_view key, std::string_view value);
+            batch& erase(std::string_view key);
+
+            /* Applies the changes in the order they were made and clears the batch, when a key is changed
+               more than once (in any case on Windows), only the last change is applied.
+               Throws std::invalid_argument and leaves the environment untouched if any key is empty,
+               contains '=' or a null char.
+            */
+            void commit();
+
+            void clear() noexcept;
+
+            // makes room for 'changes' more changes, whose keys and values add up to 'chars'
+            void reserve(std::size_t changes, std::size_t chars);
+
+            std::size_t size() const noexcept { return m_changes.size(); }
+
+            [[nodiscard]]
+            bool empty() const noexcept { return m_changes.empty(); }
+
+        private:
+            friend class env_block;
+            friend class snapshot;
+
+            // offsets into m_buffer
+            struct change
+            {
+                static constexpr auto erased = std::size_t(-1);
+
+                std::size_t key, key_size;
+                std::size_t value, value_size;
+
+                bool erases() const noexcept { return value == erased; }
+            };
+
+            // null terminated views into m_buffer
+            std::string_view key(change const& c) const noexcept {
+                return { m_buffer.data() + c.key, c.key_size };
+            }
+            std::string_view value(change const& c) const noexcept {
+                return c.erases() ? std::string_view{} : std::string_view{ m_buffer.data() + c.value, c.value_size };
+            }
+
+            /* Validates the changes, returns the last change to each key in the order they were made.
+               Keys are compared like the platform does, case insensitively on Windows.
+            */
+            std::vector<change const*> resolve() const;
+
+            std::string m_buffer;
+            std::vector<change> m_changes;
         };
 
         using iterator = ranges::basic_iterator<cursor>;
         using value_type = variable;
         using size_type = std::size_t;
-        using value_range = ranges::transform_view<environment,detail::keyval_fn>;
+#if defined(WIN32)
+        // entries have to be narrowed
+        using line_range = environment;
+#else
+        using line_range = environment_view;
+#endif
+        using value_range = ranges::transform_view<line_range,detail::keyval_fn>;
         using key_range = value_range;
+        using pair_range = ranges::transform_view<line_range,detail::keyval_pair_fn>;
 
         environment() noexcept;
 
+        /* Reads go through a small per thread cache of recently read keys (SESSIONS_HOT_KEYS entries),
+           an entry is used while the library hasn't changed the environment, the environment block
+           is the same and the entry it was read from is still in place (for unset keys, the block's size
+           and last entry are the same), so changes made elsewhere are seen.
+        */
         variable operator [] (std::string_view k) const { return variable(k); }
 
+#if !defined(WIN32)
+        /* [POSIX SPECIFIC] 'key' and its value, borrowed from the environment block without copying,
+           the value is invalidated by changes to the variable.
+        */
+        variable_ref ref(std::string_view key) const;
+#endif
+
         template <class K, meta::is_strview_ish<K> = true>
         value_type operator [] (K const& key) const { return variable(key); }
 
         template <class K, meta::is_strview_convertible<K> = true>
         iterator find(K const& key) const noexcept { return do_find(key); }
 
+        /* Keys known at compile time are looked up through the hot key cache (see operator[]) with their
+           stored hash, a repeated lookup doesn't hash the key or scan the environment.
+        */
+        template <std::size_t N>
+        value_type operator [] (env_key<N> const& key) const
+        {
+            if (key.is_static())
+                return variable(detail::kv_buffer::borrowed_key, key.str(), key.hash());
+            return variable(key.str(), key.hash());
+        }
+
+        template <std::size_t N>
+        iterator find(env_key<N> const& key) const { return do_find(key.str(), key.hash(), key.is_static()); }
+
+        template <std::size_t N>
+        bool contains(env_key<N> const& key) const { return do_find(key.str(), key.hash(), key.is_static()) != end(); }
+
+        /* Lookups that make no allocations on POSIX, and tell apart unset variables from empty ones.
+           try_get() and get_or() return views into the environment block, which are invalidated by
+           changes to the variable. [WINDOWS] values are converted into a thread local buffer,
+           the views are valid until the next call on the same thread.
+        */
         bool contains(std::string_view key) const;
 
+        std::optional<std::string_view> try_get(std::string_view key) const;
+
+        std::string_view get_or(std::string_view key, std::string_view default_value) const {
+            return try_get(key).value_or(default_value);
+        }
+
+        /* The value of 'key' parsed as T, nullopt if it's not set or can't be parsed, see value_traits.
+           Results are cached per thread and key, when the library changes the environment the value
+           is read again, and only parsed again if it changed. Changes made elsewhere aren't seen until then.
+           The cache is a fixed table of detail::typed_cache_size entries per T, keys with the same slot evict each other.
+        */
+        template <class T>
+        std::optional<T> get(std::string_view key) const;
+
+        template <class T>
+        T get(std::string_view key, T const& default_value) const { return get<T>(key).value_or(default_value); }
+
         auto begin() const noexcept {
             return iterator(begin_cursor());
         }
         auto cbegin() const noexcept { return begin(); }
 
         auto end() const noexcept {
-            return ranges::default_sentinel;
+            return iterator(end_cursor());
         }
         auto cend() const noexcept { return end(); }
 
-        size_type size () const noexcept {
-            return ranges::distance(begin(), end());
-        }
+        /* O(1), the entry count is cached and checked against changes made by the library,
+           changes made elsewhere are caught by checking where the environment block ends.
+        */
+        size_type size () const noexcept;
 
         [[nodiscard]]
         bool empty() const noexcept { return size() == 0; }
@@ -165,19 +840,530 @@ namespace detail {
         template <class K, meta::is_strview_convertible<K> = true>
         void erase(K const& key) { do_erase(key); }
 
+        // allocation free view of the environment's entries, see environment_view
+        environment_view view() const noexcept { return {}; }
+
+        // output formats of write_to()
+        enum class format : unsigned char
+        {
+            nul,   // each entry followed by a null char, like /proc/self/environ
+            shell, // export KEY='value' lines, entries whose key isn't a valid shell name are skipped
+            json,  // a single {"KEY":"value",...} object and a newline, bytes past ASCII are written as they are
+        };
+
+        /* Writes the environment's entries to the file descriptor 'fd', in the block's order.
+           Short pieces are gathered into a buffer reused for the whole call and long ones are written
+           in place, with as few writev calls as possible, nothing is allocated per entry.
+           [WINDOWS] entries are narrowed and copied into the buffer, which is written with _write.
+           Throws std::system_error if a write fails, what was written before stays written.
+        */
+        void write_to(int fd, format fmt = format::nul) const;
+
+        /* A key_index of the current environment, kept by each thread and rebuilt when the environment
+           has changed since. Checking is O(1) unless the library changed the environment, then it
+           compares tokens, see token(). Changes made elsewhere are seen when they move the block or
+           add or remove variables, a variable set again in place is seen after the next change made
+           through the library. The index keeps a copy of the environment alive until the thread exits
+           or calls drop_sorted_keys().
+        */
+        static key_index sorted_keys();
+
+        // releases the calling thread's sorted_keys() index, the next call builds a new one
+        static void drop_sorted_keys() noexcept;
+
+        // the variables whose key starts with 'prefix' sorted by key, a key_index::sorted_range, see sorted_keys()
+        static auto with_prefix(std::string_view prefix);
+
+        /* [OPT-IN] Concurrent store.
+           Once enabled, every change made through variable::operator= and erase() publishes a
+           new snapshot of the environment, which threads can read through pin() without locking,
+           while other threads change the environment.
+           Changes made outside of the library are picked up by the next published snapshot.
+        */
+        static void enable_store();
+
+        // pins the store's current snapshot, enables the store if needed
+        static pinned pin();
+
+        // lookups made through operator[] by the calling thread, see SESSIONS_HOT_KEYS
+        struct cache_stats
+        {
+            std::uint64_t hits = 0, misses = 0;
+        };
+
+        static cache_stats hot_key_stats() noexcept;
+
+        static change_token token() noexcept;
+
+        /* False if the environment block is the one 'token' was taken from, with the same entries.
+           Entries are compared by address, so changes written into an existing entry's string aren't seen,
+           setenv, putenv and unsetenv replace entries and are.
+        */
+        static bool has_changed_since(change_token const& token) noexcept { return environment::token() != token; }
+
+        /* Ranges of the environment's keys, values, and key/value pairs.
+           On POSIX these are std::string_views into the environment block and make no allocations,
+           on Windows each entry is narrowed to a std::string.
+        */
         value_range values() const noexcept {
-            return ranges::views::transform(*this, detail::keyval_fn(false));
+            return ranges::views::transform(lines(), detail::keyval_fn(false));
         }
         key_range keys() const noexcept {
-            return ranges::views::transform(*this, detail::keyval_fn(true));
+            return ranges::views::transform(lines(), detail::keyval_fn(true));
+        }
+        pair_range pairs() const noexcept {
+            return ranges::views::transform(lines(), detail::keyval_pair_fn());
         }
 
     private:
+        line_range lines() const noexcept { return {}; }
+
         void do_erase(std::string_view key);
         iterator do_find(std::string_view k) const;
+        // 'k' is an env_key's, 'hash' its hash, a static key is borrowed by the hot key cache
+        iterator do_find(std::string_view k, std::size_t hash, bool static_key) const;
     };
 
-    static_assert(ranges::bidirectional_range<environment>, "environment is a bidirectional range.");
+    static_assert(ranges::random_access_range<environment>, "environment is a rand. access range.");
+    static_assert(ranges::sized_range<environment>, "environment is a sized range.");
+    static_assert(ranges::random_access_range<environment::snapshot>, "environment::snapshot is a rand. access range.");
+
+    template <class T>
+    std::optional<T> environment::get(std::string_view key) const
+    {
+        static_assert(!std::is_same_v<T, std::string_view>, "views can't be cached, use try_get()");
+
+        struct entry
+        {
+            std::uint64_t generation = ~std::uint64_t(0);
+            std::string key;
+            std::optional<std::string> text;
+            std::optional<T> value;
+        };
+        // direct mapped by the key's hash
+        thread_local std::array<entry, detail::typed_cache_size> cache;
+
+        auto const generation = detail::env_generation();
+        auto& e = cache[detail::hash_key(key) & (cache.size() - 1)];
+        if (e.key != key)
+        {
+            // the strings keep their capacity, so a slot that was used makes few allocations
+            e.key.assign(key);
+            e.text.reset();
+            e.value.reset();
+        }
+        else if (e.generation == generation)
+            return e.value;
+
+        auto const text = try_get(key);
+        if (text != e.text)
+        {
+            if (text) {
+                if (!e.text) e.text.emplace();
+                e.text->assign(*text);
+            }
+            else
+                e.text.reset();
+
+            e.value = text ? value_traits<T>::parse(*text) : std::nullopt;
+        }
+
+        e.generation = generation;
+        return e.value;
+    }
+
+
+    /* The entries of a list-style value (PATH, CLASSPATH...) as std::string_views, indexed by a single scan.
+       Unlike split(), it's a random access range with O(1) operator[] and size().
+       n separators make n+1 entries, an empty value has none. Entries point into the value, which has to outlive the index.
+    */
+    class split_index
+    {
+        struct cursor
+        {
+            split_index const* index = nullptr;
+            std::size_t pos = 0;
+
+            std::string_view read() const noexcept { return (*index)[pos]; }
+            void next() noexcept { pos++; }
+            void prev() noexcept { pos--; }
+            void advance(std::ptrdiff_t n) noexcept { pos += n; }
+            std::ptrdiff_t distance_to(cursor const& that) const noexcept {
+                return static_cast<std::ptrdiff_t>(that.pos) - static_cast<std::ptrdiff_t>(pos);
+            }
+            bool equal(cursor const& that) const noexcept { return pos == that.pos; }
+        };
+
+    public:
+        using iterator = ranges::basic_iterator<cursor>;
+        using value_type = std::string_view;
+        using size_type = std::size_t;
+
+        split_index() = default;
+
+        // throws std::length_error if 'value' is 4GiB or larger
+        explicit split_index(std::string_view value, char sep = environment::path_separator);
+
+        value_type operator [] (size_type i) const noexcept
+        {
+            auto const begin = i == 0 ? 0 : m_ends[i - 1] + 1;
+            return m_value.substr(begin, m_ends[i] - begin);
+        }
+
+        value_type at(size_type i) const {
+            if (i >= size()) {
+                throw std::out_of_range("invalid split_index subscript");
+            }
+
+            return (*this)[i];
+        }
+
+        iterator begin() const noexcept { return iterator(cursor{ this, 0 }); }
+        iterator cbegin() const noexcept { return begin(); }
+        iterator end() const noexcept { return iterator(cursor{ this, size() }); }
+        iterator cend() const noexcept { return end(); }
+
+        size_type size() const noexcept { return m_ends.size(); }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return m_ends.empty(); }
+
+        // the whole value
+        std::string_view value() const noexcept { return m_value; }
+
+    private:
+        std::string_view m_value;
+        std::vector<std::uint32_t> m_ends; // where each entry ends, the next one starts past the separator
+    };
+
+    static_assert(ranges::random_access_range<split_index>, "split_index is a rand. access range.");
+    static_assert(ranges::sized_range<split_index>, "split_index is a sized range.");
+
+
+    /* [OPT-IN] Case insensitive lookups into a snapshot, like Windows does them, on every platform.
+       Keys are folded with an ASCII table (a-z to A-Z, other bytes must match exactly) and indexed once,
+       when it's constructed, a lookup folds and hashes the key once, with no locale calls.
+       Keys that only differ in case, like PATH and Path, are ambiguous, lookups of them follow 'policy'.
+       Copies of the snapshot share its storage, so it's cheap to keep alongside it.
+    */
+    class ci_index
+    {
+    public:
+        enum class policy : unsigned char
+        {
+            exact_first, // the entry whose key matches exactly, or else the first one in the block
+            first,       // the first one in the block, like Windows
+            reject,      // ambiguous keys aren't found
+        };
+
+        using iterator = environment::snapshot::iterator;
+
+        explicit ci_index(environment::snapshot snap, policy p = policy::exact_first);
+
+        iterator find(std::string_view key) const noexcept;
+
+        bool contains(std::string_view key) const noexcept { return find(key) != end(); }
+
+        // value of 'key', empty if it's not found
+        std::string_view operator [] (std::string_view key) const noexcept;
+
+        // true if more than one key folds to 'key'
+        bool ambiguous(std::string_view key) const noexcept;
+
+        iterator end() const noexcept { return m_snap.end(); }
+
+        environment::snapshot const& snapshot() const noexcept { return m_snap; }
+
+        policy lookup_policy() const noexcept { return m_policy; }
+
+    private:
+        struct slot
+        {
+            std::uint32_t hash;
+            std::uint32_t index : 31; // 1 based index into the snapshot, 0 marks an empty slot
+            std::uint32_t ambiguous : 1;
+        };
+
+        slot const* find_slot(std::string_view key) const noexcept;
+
+        environment::snapshot m_snap;
+        std::vector<slot> m_slots;
+        policy m_policy;
+    };
+
+
+    /* [OPT-IN] Keys of a snapshot in sorted order, for prefix and range queries.
+       The index is a single array of entry offsets sorted once, when it's constructed, queries are
+       two binary searches, O(log n + k), and return views of the entries as variable_refs.
+       Keys are compared byte by byte, repeated keys are kept in the order they appear in the snapshot,
+       so iterating the index gives the same order for the same environment.
+       Copies of the index and the ranges it returns share its storage, so they can outlive it.
+    */
+    class key_index
+    {
+        struct entry
+        {
+            std::uint32_t line;     // index into the snapshot
+            std::uint32_t key_size;
+        };
+
+        struct data
+        {
+            environment::snapshot snap;
+            std::vector<entry> entries;
+        };
+
+    public:
+        // a random access range of sorted entries
+        class sorted_range
+        {
+            struct cursor
+            {
+                data const* index = nullptr;
+                std::size_t pos = 0;
+
+                environment::variable_ref read() const noexcept { return at(*index, pos); }
+                void next() noexcept { pos++; }
+                void prev() noexcept { pos--; }
+                void advance(std::ptrdiff_t n) noexcept { pos += n; }
+                std::ptrdiff_t distance_to(cursor const& that) const noexcept {
+                    return static_cast<std::ptrdiff_t>(that.pos) - static_cast<std::ptrdiff_t>(pos);
+                }
+                bool equal(cursor const& that) const noexcept { return pos == that.pos; }
+            };
+
+        public:
+            using iterator = ranges::basic_iterator<cursor>;
+            using value_type = environment::variable_ref;
+            using size_type = std::size_t;
+
+            sorted_range() = default;
+
+            value_type operator [] (size_type i) const noexcept { return at(*m_data, m_first + i); }
+
+            iterator begin() const noexcept { return iterator(cursor{ m_data.get(), m_first }); }
+            iterator cbegin() const noexcept { return begin(); }
+            iterator end() const noexcept { return iterator(cursor{ m_data.get(), m_last }); }
+            iterator cend() const noexcept { return end(); }
+
+            size_type size() const noexcept { return m_last - m_first; }
+
+            [[nodiscard]]
+            bool empty() const noexcept { return m_first == m_last; }
+
+        private:
+            friend class key_index;
+            sorted_range(std::shared_ptr<const data> index, std::size_t first, std::size_t last) noexcept
+                : m_data(std::move(index)), m_first(first), m_last(last) {}
+
+            std::shared_ptr<const data> m_data;
+            std::size_t m_first = 0, m_last = 0;
+        };
+
+        using iterator = sorted_range::iterator;
+        using value_type = environment::variable_ref;
+        using size_type = std::size_t;
+
+        explicit key_index(environment::snapshot snap);
+
+        // the entries whose key starts with 'prefix', all of them for an empty prefix
+        sorted_range with_prefix(std::string_view prefix) const;
+
+        // the entries whose key is in [first, last)
+        sorted_range range(std::string_view first, std::string_view last) const;
+
+        // every entry, sorted by key
+        sorted_range all() const noexcept { return { m_data, 0, size() }; }
+
+        iterator begin() const noexcept { return all().begin(); }
+        iterator end() const noexcept { return all().end(); }
+
+        size_type size() const noexcept { return m_data->entries.size(); }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return size() == 0; }
+
+        environment::snapshot const& snapshot() const noexcept { return m_data->snap; }
+
+    private:
+        static environment::variable_ref at(data const& index, std::size_t i) noexcept
+        {
+            auto const& e = index.entries[i];
+            auto const line = index.snap.begin()[e.line];
+            return { line.substr(0, e.key_size), line.substr(e.key_size + 1) };
+        }
+
+        // position of the first key not less than 'key'
+        std::size_t lower_bound(std::string_view key) const noexcept;
+
+        std::shared_ptr<const data> m_data;
+    };
+
+    static_assert(ranges::random_access_range<key_index::sorted_range>, "key_index::sorted_range is a rand. access range.");
+
+    inline auto environment::with_prefix(std::string_view prefix)
+    {
+        return sorted_keys().with_prefix(prefix);
+    }
+
+
+namespace pmr {
+
+    /* Like environment::variable, but its key and value are allocated from a std::pmr::memory_resource.
+       It's allocator aware, so containers of pmr::variable allocate them from their own resource.
+    */
+    class variable
+    {
+    public:
+        using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+        explicit variable(std::string_view key, allocator_type alloc = {});
+        variable(variable const& other, allocator_type alloc = {}) : m_data(other.m_data, alloc), m_key_size(other.m_key_size) {}
+        variable(variable&&) noexcept = default;
+        variable& operator=(variable const&) = default;
+
+        std::string_view key() const noexcept { return { m_data.data(), m_key_size }; }
+        std::string_view value() const noexcept { return std::string_view(m_data).substr(m_key_size + 1); }
+        operator std::string_view() const noexcept { return value(); }
+
+        auto split (char sep = environment::path_separator) const
+        {
+            using namespace ranges;
+            return value() | views::split(sep);
+        }
+
+        split_index index(char sep = environment::path_separator) const &;
+        split_index index(char sep = environment::path_separator) const && = delete;
+
+        variable& operator=(std::string_view value);
+
+        allocator_type get_allocator() const noexcept { return m_data.get_allocator(); }
+
+    private:
+        std::pmr::string m_data; // "key\0value"
+        std::size_t m_key_size;
+    };
+
+} // namespace pmr
+
+
+    /* A ready to use environment block for starting processes (execve, posix_spawn...), made of a
+       snapshot plus the changes in a batch, the current environment is left untouched.
+       The pointer array and all strings share a single allocation. The block is immutable,
+       so it can be reused for many processes and from many threads.
+    */
+    class env_block
+    {
+    public:
+        using size_type = std::size_t;
+
+        // copy of the current environment with 'changes' applied
+        explicit env_block(environment::batch const& changes = {});
+
+        // throws std::invalid_argument if 'changes' has invalid keys, see environment::batch::commit
+        env_block(environment::snapshot const& base, environment::batch const& changes = {});
+
+        // null terminated array of key=value strings
+        detail::envchar* const* envp() const noexcept { return m_storage.get(); }
+
+        size_type size() const noexcept { return m_size; }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return m_size == 0; }
+
+    private:
+        std::unique_ptr<detail::envchar*[]> m_storage;
+        size_type m_size = 0;
+    };
+
+
+    /* What changed from one snapshot to another, each list is sorted by key.
+       Keys and values are views into the snapshots, which must outlive it.
+    */
+    struct env_diff
+    {
+        struct change
+        {
+            std::string_view key, before, after;
+        };
+
+        std::vector<environment::variable_ref> added;   // only in the second snapshot
+        std::vector<environment::variable_ref> removed; // only in the first, with their old values
+        std::vector<change> changed;
+
+        [[nodiscard]]
+        bool empty() const noexcept { return added.empty() && removed.empty() && changed.empty(); }
+    };
+
+    /* O(n), each entry is looked up in the other snapshot's index, only the differences are sorted.
+       When a snapshot has a key more than once, the entry its lookups find is used.
+    */
+    env_diff diff(environment::snapshot const& a, environment::snapshot const& b);
+
+
+    // thrown for malformed lines of a .env file
+    class env_file_error : public std::runtime_error
+    {
+    public:
+        env_file_error(std::size_t line, std::string const& what);
+
+        // 1 based line number of the error
+        std::size_t line() const noexcept { return m_line; }
+
+    private:
+        std::size_t m_line;
+    };
+
+    /* Loads the KEY=VALUE lines of a .env file into a batch, nothing changes until it's committed,
+       which applies the whole file at once. Use environment::snapshot(batch) or env_block to use the
+       file without touching the environment.
+       The file is memory mapped and parsed in a single pass, the format is:
+       - blank lines and lines starting with '#' are skipped, keys may be prefixed with 'export '
+       - whitespace around keys and unquoted values is trimmed, '#' after whitespace starts a comment
+       - 'single quoted' values are taken as is, "double quoted" ones understand \n \r \t \" \\ and \$,
+         both may span multiple lines
+       Throws std::system_error if the file can't be read and env_file_error for malformed lines.
+    */
+    environment::batch load_env_file(std::string const& path);
+
+    // parses .env formatted 'text', see load_env_file
+    environment::batch parse_env(std::string_view text);
+
+
+    /* Finds executables in the directories listed in PATH, like `which` (`where` on Windows).
+       PATH is split once and each directory's listing is indexed, so a lookup is a single hash probe.
+       The index is rebuilt when PATH changes, or when a directory's modification time does,
+       which is checked at most once every 'recheck' interval. PATH is only read again when the environment changed.
+       Whether a file is executable is cached too, and checked again on the first lookup after each 'recheck' interval.
+       Relative directories (an empty entry or ".") aren't indexed, they're searched on each lookup.
+       Names containing a directory separator are not searched for, they're returned if they are executable.
+       [WINDOWS] Names are matched case insensitively, names without an extension are tried with each one in PATHEXT.
+    */
+    class executable_cache
+    {
+    public:
+        explicit executable_cache(std::chrono::milliseconds recheck = std::chrono::seconds(1));
+        executable_cache(executable_cache const&) = delete;
+        executable_cache& operator=(executable_cache const&) = delete;
+        ~executable_cache();
+
+        // full path of 'name', nullopt if it's not found
+        std::optional<std::string> find(std::string_view name);
+
+        // one result per name, the index is validated once for all of them
+        std::vector<std::optional<std::string>> find(std::vector<std::string_view> const& names);
+
+        // drops the index, the next lookup rebuilds it
+        void clear();
+
+    private:
+        struct impl;
+        std::unique_ptr<impl> m_impl;
+    };
+
+    // lookups through a shared executable_cache, safe to call from multiple threads
+    std::optional<std::string> find_executable(std::string_view name);
+    std::vector<std::optional<std::string>> find_executables(std::vector<std::string_view> const& names);
 
 
     class arguments
@@ -230,8 +1416,10 @@ namespace detail {
         [[nodiscard]] 
         int argc() const noexcept;
 
-        /* [POSIX SPECIFIC] If SESSIONS_NOEXTENTIONS is set, users must call this function to
+        /* [POSIX SPECIFIC] If SESSIONS_NOEXTENTIONS is set, users should call this function to
             initialize arguments's global storage.
+            [LINUX] If it's never called, the arguments are read from /proc/self/cmdline on first use,
+            they're empty if it can't be read whole.
 
            On Windows, this function does nothing.
         */
@@ -242,24 +1430,135 @@ namespace detail {
     static_assert(ranges::random_access_range<arguments>, "arguments is a rand. access range.");
 
 
-    CPP_template(class Rng)
-        (requires ranges::range<Rng> && concepts::convertible_to<ranges::range_value_t<Rng>, std::string_view>)
-    std::string join_paths(Rng&& rng, char sep = environment::path_separator) {
-        using namespace ranges;
+namespace detail {
+
+    // the chars of a path list element, as a view when it can be
+    template <class T>
+    auto path_chars(T const& elem)
+    {
+        if constexpr (std::is_convertible_v<T const&, std::string_view>)
+            return std::string_view(elem);
+        else if constexpr (meta::has_narrow_native<T>::value)
+            return std::string_view(elem.native());
+        else
+            return std::string(elem.string()); // e.g. std::filesystem::path on windows
+    }
+
+    // true if the path_chars of Rng's elements stay valid while iterating it
+    template <class Rng, class Ref = ranges::range_reference_t<Rng>>
+    constexpr bool joins_views =
+        std::is_same_v<decltype(path_chars(std::declval<Ref>())), std::string_view> &&
+        (std::is_lvalue_reference_v<Ref> || std::is_trivially_copyable_v<std::decay_t<Ref>>);
 
-        std::string var = rng | views::join(sep) | to<std::string>();
-        if (var.back() == sep)
-            var.pop_back();
+    inline std::string_view separator_chars(char const& sep) noexcept { return { &sep, 1 }; }
+    inline std::string_view separator_chars(std::string_view sep) noexcept { return sep; }
 
+    /* Calls write(std::string_view) with each piece of the elements of 'rng' joined by 'sep'.
+       A trailing separator is left out, e.g. when the last element is empty.
+    */
+    template <class Rng, class Write>
+    void join_with(Rng&& rng, std::string_view sep, Write&& write)
+    {
+        // elements are written one behind, to know which one is the last
+        std::conditional_t<joins_views<Rng>, std::string_view, std::string> held;
+        bool pending = false, first = true;
+
+        for (auto&& elem : rng)
+        {
+            if (pending)
+            {
+                if (!std::exchange(first, false))
+                    write(sep);
+                write(std::string_view(held));
+            }
+            held = path_chars(elem);
+            pending = true;
+        }
+
+        std::string_view last = held;
+        if (!pending || last.empty())
+            return;
+
+        if (!first)
+            write(sep);
+        if (last.size() >= sep.size() && last.substr(last.size() - sep.size()) == sep)
+            last.remove_suffix(sep.size());
+        write(last);
+    }
+
+    // the joined size, only exact when there's no trailing separator
+    template <class Rng>
+    std::size_t joined_size(Rng&& rng, std::string_view sep)
+    {
+        std::size_t size = 0, count = 0;
+        for (auto&& elem : rng)
+        {
+            size += path_chars(elem).size();
+            count++;
+        }
+        return count ? size + (count - 1) * sep.size() : 0;
+    }
+
+} // namespace detail
+
+    /* Appends the elements of 'rng' joined by 'sep' to 'out', and returns 'out'.
+       Elements can be strings or std::filesystem::paths, which on POSIX aren't copied.
+       The joined size of forward ranges is computed first, so 'out' grows at most once.
+    */
+    CPP_template(class Traits, class Alloc, class Rng, class Sep = char)
+        (requires ranges::range<Rng> && meta::is_path_like<ranges::range_value_t<Rng>> && meta::is_separator<Sep>)
+    std::basic_string<char, Traits, Alloc>& join_paths_into(std::basic_string<char, Traits, Alloc>& out, Rng&& rng, Sep const& sep = environment::path_separator)
+    {
+        auto const sepchars = detail::separator_chars(sep);
+
+        if constexpr (ranges::forward_range<Rng> && detail::joins_views<Rng>)
+            out.reserve(out.size() + detail::joined_size(rng, sepchars));
+
+        detail::join_with(rng, sepchars, [&out](std::string_view piece) { out.append(piece.data(), piece.size()); });
+        return out;
+    }
+
+    // writes the elements of 'rng' joined by 'sep' to 'out', returns the iterator past the last char written
+    CPP_template(class OutIt, class Rng, class Sep = char)
+        (requires ranges::output_iterator<OutIt, char> && ranges::range<Rng> && meta::is_path_like<ranges::range_value_t<Rng>> && meta::is_separator<Sep>)
+    OutIt join_paths_into(OutIt out, Rng&& rng, Sep const& sep = environment::path_separator)
+    {
+        detail::join_with(rng, detail::separator_chars(sep), [&out](std::string_view piece) {
+            out = std::copy(piece.begin(), piece.end(), out);
+        });
+        return out;
+    }
+
+    // 'sep' can be a char or a string
+    CPP_template(class Rng, class Sep = char)
+        (requires ranges::range<Rng> && meta::is_path_like<ranges::range_value_t<Rng>> && meta::is_separator<Sep>)
+    std::string join_paths(Rng&& rng, Sep const& sep = environment::path_separator) {
+        std::string var;
+        join_paths_into(var, rng, sep);
         return var;
     }
 
-    CPP_template(class Iter)
-        (requires concepts::convertible_to<ranges::iter_value_t<Iter>, std::string_view>)
-    std::string join_paths(Iter begin, Iter end, char sep = environment::path_separator) {
+    CPP_template(class Iter, class Sep = char)
+        (requires meta::is_path_like<ranges::iter_value_t<Iter>> && meta::is_separator<Sep>)
+    std::string join_paths(Iter begin, Iter end, Sep const& sep = environment::path_separator) {
         return join_paths(ranges::subrange(begin, end), sep);
     }
 
+    // join_paths with the result allocated from 'mr'
+    CPP_template(class Rng, class Sep)
+        (requires ranges::range<Rng> && meta::is_path_like<ranges::range_value_t<Rng>> && meta::is_separator<Sep>)
+    std::pmr::string join_paths(Rng&& rng, Sep const& sep, std::pmr::memory_resource* mr) {
+        std::pmr::string var{ mr };
+        join_paths_into(var, rng, sep);
+        return var;
+    }
+
+    CPP_template(class Iter, class Sep)
+        (requires meta::is_path_like<ranges::iter_value_t<Iter>> && meta::is_separator<Sep>)
+    std::pmr::string join_paths(Iter begin, Iter end, Sep const& sep, std::pmr::memory_resource* mr) {
+        return join_paths(ranges::subrange(begin, end), sep, mr);
+    }
+
 } /* namespace red::session */
 
 #endif /* RED_SESSIONS_HPP */
\ No newline at end of file
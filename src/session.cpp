@@ -3,30 +3,111 @@
 #   define _CRT_SECURE_NO_WARNINGS
 #   include "win32.hpp"
 #   include <shellapi.h>
+#   include <io.h>
 #elif defined(__unix__)
 #   include <unistd.h>
+#   include <fcntl.h>
+#   include <dirent.h>
+#   include <sys/stat.h>
+#   include <sys/mman.h>
+#   include <sys/uio.h>
 #endif
+#if defined(__unix__) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#   define SESSIONS_SIMD_FIND
+#   include <immintrin.h>
+#endif
+#include <array>
 #include <vector>
+#include <unordered_map>
+#include <optional>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <limits>
+#include <climits>
 #include <locale>
 #include <system_error>
+#include <stdexcept>
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <new>
 #include <cassert>
 #include <range/v3/algorithm.hpp>
 #include "red/sessions/session.hpp"
 
 using std::string; using std::wstring;
 using std::string_view; using std::wstring_view;
+using namespace std::literals;
 
 // system layer
 namespace sys {
     using red::session::detail::envchar;
     using red::session::detail::envblock;
 
+    // the environment block, never null: a null block (e.g. after clearenv()) is replaced by an empty one
     envblock envp() noexcept;
 
+    // entry of the environment block with 'key', or its terminating null entry
+    envblock find(std::string_view key);
+
     std::string getenv(std::string_view key);
     void setenv(std::string_view key, std::string_view value);
     void rmenv(std::string_view key);
+
+    // value of 'key' as a view into the environment block, or into 'buffer' when it has to be converted
+    std::optional<std::string_view> getenv(std::string_view key, std::string& buffer);
+
+    bool contains(std::string_view key);
+
+    // null terminated variants, avoid copying keys and values that already are
+    void setenv(char const* key, char const* value);
+    void rmenv(char const* key);
+
+    // modification time of 'path', 0 if it can't be read
+    std::int64_t mtime(std::string const& path);
+
+    // names of the entries in 'dir' that aren't directories, empty if it can't be read
+    std::vector<std::string> listdir(std::string const& dir);
+
+    // true if 'file' is a file that can be executed
+    bool executable(std::string const& file);
+
+    // writes all of 'chunks' to 'fd' in order, with as few calls as possible and retrying partial writes,
+    // throws std::system_error if a write fails
+    void write_all(int fd, std::string_view const* chunks, std::size_t count);
+
+    // read only view of a whole file, throws std::system_error if it can't be mapped
+    class mapped_file
+    {
+    public:
+        explicit mapped_file(std::string const& path);
+        mapped_file(mapped_file const&) = delete;
+        mapped_file& operator=(mapped_file const&) = delete;
+        ~mapped_file();
+
+        std::string_view data() const noexcept { return { m_data, m_size }; }
+
+    private:
+        char const* m_data = nullptr;
+        std::size_t m_size = 0;
+    };
+
+#if !defined(WIN32)
+    // the arguments as argc and a null terminated argv, the strings are stored after the array
+    struct cmdline_args
+    {
+        std::unique_ptr<char const*[]> storage;
+        int argc = 0;
+    };
+
+    // [LINUX] the arguments read from /proc/self/cmdline, for when arguments::init wasn't called,
+    // empty if they can't be read whole
+    cmdline_args read_cmdline() noexcept;
+#endif
     
 } // namespace sys
 
@@ -62,6 +143,21 @@ struct envstr_finder
     }
 };
 
+// length of the key in a key=value line, npos if there's no '='.
+// starts at 1 since hidden variables on windows begin with '=', e.g. "=C:=C:\\"
+size_t key_length(string_view line) noexcept
+{
+    return line.empty() ? string_view::npos : line.find('=', 1);
+}
+
+bool key_equals(string_view line, string_view key) noexcept
+{
+    return
+        line.length() > key.length() &&
+        line[key.length()] == '=' &&
+        line.compare(0, key.length(), key) == 0;
+}
+
 } // unnamed namespace
 
 #if defined(WIN32)
@@ -74,32 +170,31 @@ constexpr auto NARROW_CP =
     CP_ACP;
 #endif // SESSIONS_UTF8
 
+using red::session::detail::ascii_upper;
+
+// folds with a table instead of the locale's toupper, it's the same fold as the "C" locale's
 struct ci_char_traits : public std::char_traits<char> {
     using typename std::char_traits<char>::char_type;
 
     static bool eq(char_type c1, char_type c2) {
-        auto& LC = std::locale::classic();
-        return toupper(c1, LC) == toupper(c2, LC);
+        return ascii_upper(c1) == ascii_upper(c2);
     }
     static bool lt(char_type c1, char_type c2) {
-        auto& LC = std::locale::classic();
-        return toupper(c1, LC) < toupper(c2, LC);
+        return ascii_upper(c1) < ascii_upper(c2);
     }
     static int compare(const char_type* s1, const char_type* s2, size_t n) {
-        auto& LC = std::locale::classic();
         while (n-- != 0) {
-            if (toupper(*s1, LC) < toupper(*s2, LC)) return -1;
-            if (toupper(*s1, LC) > toupper(*s2, LC)) return 1;
+            if (ascii_upper(*s1) < ascii_upper(*s2)) return -1;
+            if (ascii_upper(*s1) > ascii_upper(*s2)) return 1;
             ++s1; ++s2;
         }
         return 0;
     }
     static const char_type* find(const char_type* s, int n, char_type a) {
-        auto& LC = std::locale::classic();
-        auto const ua = toupper(a, LC);
+        auto const ua = ascii_upper(a);
         while (n-- != 0)
         {
-            if (toupper(*s, LC) == ua)
+            if (ascii_upper(*s) == ua)
                 return s;
             s++;
         }
@@ -204,7 +299,17 @@ namespace {
 } // unnamed namespace
 
 sys::envblock sys::envp() noexcept {
-    return _wenviron;
+    static envchar* empty[1] = {};
+    return _wenviron ? _wenviron : empty;
+}
+
+sys::envblock sys::find(string_view k) {
+    auto entry = envp();
+    auto finder = envfind_fn(k);
+    while (*entry && !finder(to_narrow(*entry)))
+        ++entry;
+
+    return entry;
 }
 
 string sys::getenv(string_view k) {
@@ -216,6 +321,29 @@ string sys::getenv(string_view k) {
     }
     else return {};
 }
+std::optional<string_view> sys::getenv(string_view k, string& buffer) {
+    auto wkey = to_wide(k);
+    auto* var = _wgetenv(wkey.c_str());
+    if (!var)
+        return std::nullopt;
+
+    buffer = to_narrow(var);
+    return string_view(buffer);
+}
+bool sys::contains(string_view k) {
+    // short keys are converted on the stack
+    wchar_t buffer[256];
+    if (k.size() < std::size(buffer))
+    {
+        auto length = wide(k.data(), (int)k.size(), buffer, (int)std::size(buffer) - 1);
+        if (length > 0 || k.empty()) {
+            buffer[length] = L'\0';
+            return _wgetenv(buffer) != nullptr;
+        }
+    }
+
+    return _wgetenv(to_wide(k).c_str()) != nullptr;
+}
 void sys::setenv(string_view key, string_view value) {
     auto wkey = to_wide(key);
     auto wvalue = to_wide(value);
@@ -225,6 +353,91 @@ void sys::rmenv(string_view k) {
     auto wkey = to_wide(k);
     _wputenv_s(wkey.c_str(), L"");
 }
+void sys::setenv(char const* key, char const* value) {
+    sys::setenv(string_view(key), string_view(value));
+}
+void sys::rmenv(char const* key) {
+    sys::rmenv(string_view(key));
+}
+std::int64_t sys::mtime(string const& path) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(to_wide(path).c_str(), GetFileExInfoStandard, &data))
+        return 0;
+
+    return (std::int64_t(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+std::vector<string> sys::listdir(string const& dir) {
+    std::vector<string> names;
+    WIN32_FIND_DATAW data;
+    auto const pattern = to_wide(dir) + L"\\*";
+
+    auto h = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE)
+        return names;
+
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            names.push_back(to_narrow(data.cFileName));
+    } while (FindNextFileW(h, &data));
+
+    FindClose(h);
+    return names;
+}
+bool sys::executable(string const& file) {
+    auto const attributes = GetFileAttributesW(to_wide(file).c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+sys::mapped_file::mapped_file(string const& path) {
+    auto const file = CreateFileW(to_wide(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw_win_error();
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        auto const error = GetLastError();
+        CloseHandle(file);
+        throw_win_error(error);
+    }
+
+    m_size = static_cast<size_t>(size.QuadPart);
+    if (m_size == 0) {
+        CloseHandle(file);
+        return;
+    }
+
+    // the view keeps the mapping and the file open
+    auto const mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    auto error = GetLastError();
+    CloseHandle(file);
+    if (!mapping)
+        throw_win_error(error);
+
+    auto const view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    error = GetLastError();
+    CloseHandle(mapping);
+    if (!view)
+        throw_win_error(error);
+
+    m_data = static_cast<char const*>(view);
+}
+sys::mapped_file::~mapped_file() {
+    if (m_data)
+        UnmapViewOfFile(m_data);
+}
+void sys::write_all(int fd, string_view const* chunks, size_t count) {
+    for (size_t i = 0; i < count; i++)
+    {
+        for (auto chunk = chunks[i]; !chunk.empty(); )
+        {
+            auto const size = static_cast<unsigned>(std::min<size_t>(chunk.size(), INT_MAX));
+            auto const written = _write(fd, chunk.data(), size);
+            if (written < 0)
+                throw std::system_error(errno, std::generic_category(), "_write");
+            chunk.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+}
 
 namespace red::session {
 
@@ -232,6 +445,20 @@ string detail::narrow_copy(envchar const* s) {
     return s ? to_narrow(s) : "";
 }
 
+std::pmr::string detail::pmr_narrow_copy(envchar const* s, std::pmr::memory_resource* mr) {
+    std::pmr::string str{ mr };
+    if (!s)
+        return str;
+
+    auto length = narrow(s);
+    str.resize(length);
+    if (narrow(s, -1, str.data(), length) == 0)
+        throw_win_error();
+
+    str.pop_back(); // null terminator
+    return str;
+}
+
 const char** arguments::argv() const noexcept {
     return argvec().data();
 }
@@ -252,6 +479,12 @@ environment::environment() noexcept
         _wgetenv(L"Red Sessions init wchar env");
 }
 
+std::optional<string_view> environment::try_get(string_view key) const
+{
+    thread_local string buffer;
+    return sys::getenv(key, buffer);
+}
+
 } // namespace red::session
 
 
@@ -263,12 +496,220 @@ namespace
 {
     char const** my_args{};
     int my_args_count{};
+
+    // read on first use, startup doesn't pay for it
+    sys::cmdline_args const& lazy_args() noexcept
+    {
+        static sys::cmdline_args const args = sys::read_cmdline();
+        return args;
+    }
+}
+
+sys::cmdline_args sys::read_cmdline() noexcept
+{
+    cmdline_args result;
+#if defined(__linux__)
+    auto const fd = ::open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return result;
+
+    // most command lines fit on the stack, so the argv block is the only allocation
+    char stack[4096];
+    std::unique_ptr<char[]> heap;
+    char* data = stack;
+    size_t capacity = sizeof(stack), size = 0;
+
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            std::unique_ptr<char[]> bigger{ new (std::nothrow) char[capacity * 2] };
+            if (!bigger) {
+                ::close(fd);
+                return result; // truncated arguments would pass for the whole command line
+            }
+            std::copy(data, data + size, bigger.get());
+            heap = std::move(bigger);
+            data = heap.get();
+            capacity *= 2;
+        }
+
+        auto const n = ::read(fd, data + size, capacity - size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ::close(fd);
+            return result;
+        }
+        if (n == 0)
+            break;
+        size += static_cast<size_t>(n);
+    }
+    ::close(fd);
+
+    if (size == 0)
+        return result;
+
+    // each argument is null terminated, unless the process rewrote its argv
+    auto const terminated = data[size - 1] == '\0';
+    auto const chars = size + !terminated;
+    auto const argc = static_cast<size_t>(std::count(data, data + size, '\0')) + !terminated;
+
+    auto const ptrs = argc + 1;
+    auto const ptr_size = sizeof(char const*);
+    result.storage.reset(new (std::nothrow) char const*[ptrs + (chars + ptr_size - 1) / ptr_size]);
+    if (!result.storage)
+        return result;
+
+    auto strings = reinterpret_cast<char*>(result.storage.get() + ptrs);
+    std::copy(data, data + size, strings);
+    strings[chars - 1] = '\0';
+
+    for (size_t arg = 0, pos = 0; arg < argc; arg++)
+    {
+        result.storage[arg] = strings + pos;
+        pos += std::strlen(strings + pos) + 1;
+    }
+    result.storage[argc] = nullptr;
+    result.argc = static_cast<int>(argc);
+#endif
+    return result;
 }
 
 using envfind_fn = envstr_finder<std::char_traits<char>>;
 
-sys::env_t sys::envp() noexcept {
-    return environ;
+namespace
+{
+    using find_kernel = char** (*)(char** block, string_view key) noexcept;
+
+    char** find_scalar(char** block, string_view key) noexcept
+    {
+        auto finder = envfind_fn(key);
+        while (*block && !finder(*block))
+            ++block;
+
+        return block;
+    }
+
+#if defined(SESSIONS_SIMD_FIND)
+    /* The vector kernels compare the first 16/32 bytes of 'key=' against each entry at once.
+       Entries may be shorter than that, loads past their end are only done when they don't
+       cross into the next page, so they can't fault. 'key' must not contain null chars.
+    */
+    template <size_t width>
+    bool page_safe(char const* p) noexcept
+    {
+        return (reinterpret_cast<std::uintptr_t>(p) & 4095) <= 4096 - width;
+    }
+
+    bool entry_matches(char const* entry, string_view key, size_t from) noexcept
+    {
+        return
+            std::strncmp(entry + from, key.data() + from, key.size() - from) == 0 &&
+            entry[key.size()] == '=';
+    }
+
+    // key followed by '=', truncated to 'width'
+    template <size_t width>
+    struct needle
+    {
+        alignas(width) char bytes[width] = {};
+        size_t length;
+        std::uint32_t mask;
+
+        explicit needle(string_view key) noexcept : length(std::min(key.size() + 1, width))
+        {
+            for (size_t i = 0; i < length; i++)
+                bytes[i] = i < key.size() ? key[i] : '=';
+
+            mask = length == 32 ? ~std::uint32_t(0) : (std::uint32_t(1) << length) - 1;
+        }
+    };
+
+    __attribute__((target("sse2"), no_sanitize_address))
+    char** find_sse2(char** block, string_view key) noexcept
+    {
+        auto const n = needle<16>(key);
+        auto const vn = _mm_load_si128(reinterpret_cast<__m128i const*>(n.bytes));
+
+        for (; *block; ++block)
+        {
+            char const* e = *block;
+            if (e[0] != n.bytes[0])
+                continue;
+
+            if (!page_safe<16>(e)) {
+                if (entry_matches(e, key, 0))
+                    return block;
+                continue;
+            }
+
+            auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(e));
+            auto const eq = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vn)));
+            if ((eq & n.mask) == n.mask && (key.size() < 16 || entry_matches(e, key, 16)))
+                return block;
+        }
+
+        return block;
+    }
+
+    __attribute__((target("avx2"), no_sanitize_address))
+    char** find_avx2(char** block, string_view key) noexcept
+    {
+        auto const n = needle<32>(key);
+        auto const vn = _mm256_load_si256(reinterpret_cast<__m256i const*>(n.bytes));
+
+        for (; *block; ++block)
+        {
+            char const* e = *block;
+            if (e[0] != n.bytes[0])
+                continue;
+
+            if (!page_safe<32>(e)) {
+                if (entry_matches(e, key, 0))
+                    return block;
+                continue;
+            }
+
+            auto const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(e));
+            auto const eq = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vn)));
+            if ((eq & n.mask) == n.mask && (key.size() < 32 || entry_matches(e, key, 32)))
+                return block;
+        }
+
+        return block;
+    }
+#endif // SESSIONS_SIMD_FIND
+
+    find_kernel select_find_kernel() noexcept
+    {
+#if defined(SESSIONS_SIMD_FIND)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return find_avx2;
+        if (__builtin_cpu_supports("sse2"))
+            return find_sse2;
+#endif
+        return find_scalar;
+    }
+}
+
+sys::envblock sys::envp() noexcept {
+    static char* empty[1] = {};
+    return environ ? environ : empty;
+}
+
+sys::envblock sys::find(string_view k) {
+    static auto const kernel = select_find_kernel();
+
+    // the kernels read the block without checking it, envp() doesn't return null ones
+    auto const block = envp();
+
+    // keys can't hold null chars, the kernels rely on it
+    if (k.empty() || k.find('\0') != string_view::npos)
+        return find_scalar(block, k);
+
+    return kernel(block, k);
 }
 
 string sys::getenv(string_view k) {
@@ -276,6 +717,16 @@ string sys::getenv(string_view k) {
     char* val = ::getenv(key.c_str());
     return val ? val : "";
 }
+std::optional<string_view> sys::getenv(string_view k, string&) {
+    auto entry = *sys::find(k);
+    if (!entry)
+        return std::nullopt;
+
+    return string_view(entry + k.size() + 1);
+}
+bool sys::contains(string_view k) {
+    return *sys::find(k) != nullptr;
+}
 void sys::setenv(string_view k, string_view v) {
     string key{k}, value{v};
     ::setenv(key.c_str(), value.c_str(), true);
@@ -284,6 +735,103 @@ void sys::rmenv(string_view k) {
     string key{k};
     ::unsetenv(key.c_str());
 }
+void sys::setenv(char const* key, char const* value) {
+    ::setenv(key, value, true);
+}
+void sys::rmenv(char const* key) {
+    ::unsetenv(key);
+}
+std::int64_t sys::mtime(string const& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return 0;
+
+    return std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+std::vector<string> sys::listdir(string const& dir) {
+    std::vector<string> names;
+    auto d = ::opendir(dir.c_str());
+    if (!d)
+        return names;
+
+    while (auto entry = ::readdir(d))
+    {
+        // d_type may be unknown, those are checked on lookup
+        if (entry->d_type != DT_DIR)
+            names.emplace_back(entry->d_name);
+    }
+
+    ::closedir(d);
+    return names;
+}
+bool sys::executable(string const& file) {
+    struct stat st;
+    return ::stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(file.c_str(), X_OK) == 0;
+}
+sys::mapped_file::mapped_file(string const& path) {
+    auto const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        auto const error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    m_size = static_cast<size_t>(st.st_size);
+    if (m_size == 0) {
+        ::close(fd);
+        return;
+    }
+
+    auto const p = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto const error = errno;
+    ::close(fd);
+    if (p == MAP_FAILED)
+        throw std::system_error(error, std::generic_category(), path);
+
+    ::madvise(p, m_size, MADV_SEQUENTIAL);
+    m_data = static_cast<char const*>(p);
+}
+sys::mapped_file::~mapped_file() {
+    if (m_data)
+        ::munmap(const_cast<char*>(m_data), m_size);
+}
+void sys::write_all(int fd, string_view const* chunks, size_t count) {
+#if defined(IOV_MAX)
+    constexpr size_t max_iov = IOV_MAX < 1024 ? IOV_MAX : 1024;
+#else
+    constexpr size_t max_iov = 16;
+#endif
+    iovec iov[max_iov];
+    size_t done = 0; // bytes of chunks[0] already written
+
+    while (count > 0)
+    {
+        size_t n = 0;
+        for (; n < count && n < max_iov; n++) {
+            auto const skip = n == 0 ? done : 0;
+            iov[n] = iovec{ const_cast<char*>(chunks[n].data()) + skip, chunks[n].size() - skip };
+        }
+
+        auto const written = ::writev(fd, iov, static_cast<int>(n));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category(), "writev");
+        }
+
+        // skips what was written, a partial write resumes inside a chunk
+        auto left = static_cast<size_t>(written);
+        for (; count > 0 && left >= chunks[0].size() - done; chunks++, count--) {
+            left -= chunks[0].size() - done;
+            done = 0;
+        }
+        done += left;
+    }
+}
 
 namespace red::session {
 
@@ -291,12 +839,16 @@ string detail::narrow_copy(envchar const* s) {
     return s ? s : "";
 }
 
+std::pmr::string detail::pmr_narrow_copy(envchar const* s, std::pmr::memory_resource* mr) {
+    return s ? std::pmr::string(s, mr) : std::pmr::string(mr);
+}
+
 const char** arguments::argv() const noexcept {
-    return my_args;
+    return my_args ? my_args : lazy_args().storage.get();
 }
 
 int arguments::argc() const noexcept {
-    return my_args_count;
+    return my_args ? my_args_count : lazy_args().argc;
 }
 
 void arguments::init(int count, const char** arguments) noexcept
@@ -307,6 +859,17 @@ void arguments::init(int count, const char** arguments) noexcept
 
 const char environment::path_separator = ':';
 
+std::optional<string_view> environment::try_get(string_view key) const
+{
+    string unused; // values are never converted
+    return sys::getenv(key, unused);
+}
+
+auto environment::ref(string_view key) const -> variable_ref
+{
+    return { key, try_get(key).value_or(string_view{}) };
+}
+
 environment::environment() noexcept = default;
 
 } // namespace red::session
@@ -314,39 +877,1892 @@ environment::environment() noexcept = default;
 #   error "unknown platform"
 #endif
 
+// concurrent store
+namespace red::session::detail {
+
+// per thread record of the epoch a reader has pinned
+struct reader_slot
+{
+    static constexpr auto idle = std::numeric_limits<std::uint64_t>::max();
+
+    std::atomic<std::uint64_t> epoch{idle};
+    std::atomic<bool> in_use{true};
+    unsigned depth = 0; // pin() nesting, only touched by the owning thread
+    reader_slot* next = nullptr;
+};
+
+} // namespace red::session::detail
+
+namespace {
+
+using red::session::environment;
+using red::session::detail::reader_slot;
+
+/* Snapshots are published through an atomic pointer and reclaimed with epochs:
+   readers announce the epoch they entered at before loading the pointer, a replaced
+   snapshot is retired at the next epoch and freed once no reader announces an older one.
+*/
+struct env_store
+{
+    std::atomic<environment::snapshot const*> current{nullptr};
+    std::atomic<std::uint64_t> epoch{1};
+    std::atomic<reader_slot*> slots{nullptr};
+
+    std::mutex writer; // serializes changes to the environment, publishing and reclamation
+    std::vector<std::pair<std::uint64_t, environment::snapshot const*>> retired;
+
+    ~env_store()
+    {
+        delete current.load();
+        for (auto& r : retired)
+            delete r.second;
+        for (auto s = slots.load(); s;) {
+            delete std::exchange(s, s->next);
+        }
+    }
+
+    // must hold 'writer'
+    void publish()
+    {
+        auto old = current.exchange(new environment::snapshot());
+        if (!old)
+            return;
+
+        retired.emplace_back(epoch.fetch_add(1) + 1, old);
+
+        auto oldest = reader_slot::idle;
+        for (auto s = slots.load(); s; s = s->next)
+            oldest = std::min(oldest, s->epoch.load());
+
+        auto reclaimable = [oldest](auto const& r) {
+            if (r.first > oldest)
+                return false;
+            delete r.second;
+            return true;
+        };
+        retired.erase(std::remove_if(retired.begin(), retired.end(), reclaimable), retired.end());
+    }
+
+    reader_slot* acquire_slot()
+    {
+        for (auto s = slots.load(); s; s = s->next)
+        {
+            bool free = false;
+            if (s->in_use.compare_exchange_strong(free, true))
+                return s;
+        }
+
+        auto s = new reader_slot;
+        s->next = slots.load();
+        while (!slots.compare_exchange_weak(s->next, s))
+            ;
+        return s;
+    }
+};
+
+env_store& store()
+{
+    static env_store instance;
+    return instance;
+}
+
+// the calling thread's reader slot, released for reuse when the thread exits
+reader_slot* thread_slot()
+{
+    struct holder
+    {
+        reader_slot* slot = store().acquire_slot();
+        ~holder() { slot->in_use = false; }
+    };
+
+    thread_local holder h;
+    return h.slot;
+}
+
+// bumped by every change made through the library
+std::atomic<std::uint64_t> generation{0};
+
+// applies a change to the environment, publishing a new snapshot if the store is enabled
+template <class Fn>
+void mutate(Fn&& fn)
+{
+    auto& st = store();
+    std::lock_guard<std::mutex> lock{ st.writer };
+
+    fn();
+    generation++;
+    if (st.current.load())
+        st.publish();
+}
+
+/* Entry count of the environment block, cached per thread against the generation and the block's address.
+   Changes made outside the library may keep the same block, those are caught by checking
+   the null terminator is still right after the last entry.
+*/
+size_t entry_count() noexcept
+{
+    struct cache
+    {
+        std::uint64_t generation = ~std::uint64_t(0);
+        sys::envblock block = nullptr;
+        size_t count = 0;
+    };
+    thread_local cache c;
+
+    auto const block = sys::envp();
+    auto const gen = generation.load();
+
+    if (!block)
+        return 0;
+
+    if (c.generation == gen && c.block == block && !block[c.count] && (c.count == 0 || block[c.count - 1]))
+        return c.count;
+
+    size_t count = 0;
+    while (block[count])
+        count++;
+
+    c = cache{ gen, block, count };
+    return count;
+}
+
+/* Where a variable was found in the environment block, to tell without scanning the block whether it may have changed.
+   Changes made outside the library that keep the block are caught by checking the entry is still at its index,
+   or for unset variables, that the block's size and last entry are unchanged (new entries are added at the end).
+*/
+struct env_position
+{
+    std::uint64_t generation = ~std::uint64_t(0);
+    sys::envblock block = nullptr;
+    size_t index = 0;                      // of the entry, or the block's size if it's not set
+    sys::envchar const* line = nullptr; // the entry, or the block's last entry if it's not set
+    bool found = false;
+
+    // 'entry' is what sys::find returned for the variable
+    void update(sys::envblock entry, std::uint64_t gen) noexcept
+    {
+        generation = gen;
+        block = sys::envp();
+        index = static_cast<size_t>(entry - block);
+        found = *entry != nullptr;
+        line = found ? *entry : index ? block[index - 1] : nullptr;
+    }
+
+    bool current(std::uint64_t gen) const noexcept
+    {
+        if (generation != gen || block != sys::envp())
+            return false;
+
+        auto const count = entry_count();
+        if (found)
+            return index < count && block[index] == line;
+
+        return index == count && (count == 0 || block[count - 1] == line);
+    }
+};
+
+} // unnamed namespace
+
 // common
 namespace red::session {
 
-environment::variable::variable(std::string_view key_) : m_key(key_)
+std::uint64_t detail::env_generation() noexcept
 {
-    m_value = sys::getenv(m_key);
+    return generation.load();
 }
 
-auto environment::variable::operator= (string_view value) -> variable&
+detail::kv_buffer::kv_buffer(string_view key, string_view value) : m_key_size(key.size())
 {
-    sys::setenv(m_key, value);
-    m_value = string(value);
-    return *this;
+    store(key, value);
 }
 
-auto environment::begin_cursor() const -> cursor
+detail::kv_buffer::kv_buffer(borrowed_key_t, string_view key, string_view value) : m_borrowed(key.data()), m_key_size(key.size())
 {
-    return cursor(sys::envp());
+    store(key, value);
 }
 
-auto environment::do_find(string_view k) const ->iterator
+void detail::kv_buffer::store(string_view key, string_view value)
 {
-    return ranges::find_if(*this, envfind_fn(k));
+    m_value_size = value.size();
+
+    char* out = m_inline;
+    auto const size = stored_size();
+    if (size > inline_size)
+        out = m_heap = new char[size];
+
+    if (!m_borrowed) {
+        std::copy(key.begin(), key.end(), out);
+        out[key.size()] = '\0';
+    }
+
+    std::copy(value.begin(), value.end(), out + value_offset());
+    out[size - 1] = '\0';
 }
 
-bool environment::contains(string_view k) const
+detail::kv_buffer::kv_buffer(kv_buffer&& other) noexcept
+    : m_heap(std::exchange(other.m_heap, nullptr)), m_borrowed(other.m_borrowed), m_key_size(other.m_key_size), m_value_size(other.m_value_size)
 {
-    return !sys::getenv(k).empty();
+    if (!m_heap)
+        std::copy(other.m_inline, other.m_inline + stored_size(), m_inline);
 }
 
-void environment::do_erase(string_view k)
+auto detail::kv_buffer::operator= (kv_buffer other) noexcept -> kv_buffer&
 {
-    sys::rmenv(k);
+    delete[] m_heap;
+    m_heap = std::exchange(other.m_heap, nullptr);
+    m_borrowed = other.m_borrowed;
+    m_key_size = other.m_key_size;
+    m_value_size = other.m_value_size;
+
+    if (!m_heap)
+        std::copy(other.m_inline, other.m_inline + stored_size(), m_inline);
+
+    return *this;
+}
+
+void detail::kv_buffer::assign_value(string_view value)
+{
+    *this = m_borrowed ? kv_buffer(borrowed_key, key(), value) : kv_buffer(key(), value);
+}
+
+// hot keys
+
+namespace {
+
+static_assert((SESSIONS_HOT_KEYS & (SESSIONS_HOT_KEYS - 1)) == 0, "SESSIONS_HOT_KEYS must be a power of 2");
+
+// the keys last read by a thread, direct mapped by their hash
+struct hot_key_cache
+{
+    struct entry
+    {
+        std::size_t hash = 0;
+        string_view key;   // into 'storage', or an env_key's literal
+        string storage, value;
+        env_position position;
+    };
+
+    std::array<entry, std::max(SESSIONS_HOT_KEYS, 1)> entries;
+    environment::cache_stats stats;
+};
+
+thread_local hot_key_cache hot_keys;
+
+/* The calling thread's cache entry of 'key', read again if it's stale, 'hash' is detail::hash_key(key).
+   Keys with static storage (env_key's) are kept as they are, others are copied.
+*/
+hot_key_cache::entry const& cached_entry(string_view key, size_t hash, bool static_key = false)
+{
+    auto& cache = hot_keys;
+    auto& e = cache.entries[hash & (cache.entries.size() - 1)];
+    auto const gen = generation.load();
+
+    if (e.hash == hash && e.key == key && e.position.current(gen)) {
+        cache.stats.hits++;
+        return e;
+    }
+
+    cache.stats.misses++;
+    auto const found = sys::find(key);
+#if defined(WIN32)
+    string buffer;
+    auto const value = sys::getenv(key, buffer).value_or(string_view{});
+#else
+    auto const value = *found ? string_view(*found + key.size() + 1) : string_view{};
+#endif
+
+    if (static_key)
+        e.key = key;
+    else {
+        e.storage.assign(key);
+        e.key = e.storage;
+    }
+    e.hash = hash;
+    e.value.assign(value);
+    e.position.update(found, gen);
+    return e;
+}
+
+// value of 'key' for a new variable, valid until the calling thread's next lookup
+string_view variable_value(string_view key, size_t hash, bool static_key = false)
+{
+    if constexpr (SESSIONS_HOT_KEYS > 0)
+        return cached_entry(key, hash, static_key).value;
+
+    thread_local string buffer;
+    return sys::getenv(key, buffer).value_or(string_view{});
+}
+
+} // unnamed namespace
+
+environment::variable::variable(std::string_view key_) : variable(key_, detail::hash_key(key_))
+{
+}
+
+environment::variable::variable(std::string_view key_, size_t hash) : m_data(key_, variable_value(key_, hash))
+{
+}
+
+environment::variable::variable(detail::kv_buffer::borrowed_key_t, std::string_view key_, size_t hash)
+    : m_data(detail::kv_buffer::borrowed_key, key_, variable_value(key_, hash, true))
+{
+}
+
+auto environment::hot_key_stats() noexcept -> cache_stats
+{
+    return hot_keys.stats;
+}
+
+auto environment::variable::operator= (string_view value) -> variable&
+{
+    m_data.assign_value(value);
+    mutate([this] { sys::setenv(m_data.key_c_str(), m_data.value_c_str()); });
+    return *this;
+}
+
+pmr::variable::variable(string_view key, allocator_type alloc) : m_data(alloc), m_key_size(key.size())
+{
+    string buffer;
+    auto const value = sys::getenv(key, buffer).value_or(string_view{});
+
+    m_data.reserve(key.size() + value.size() + 1);
+    m_data.append(key).append(1, '\0').append(value);
+}
+
+auto pmr::variable::operator= (string_view value) -> variable&
+{
+    // 'value' may point into m_data
+    std::pmr::string data{ m_data.get_allocator() };
+    data.reserve(m_key_size + value.size() + 1);
+    data.append(key()).append(1, '\0').append(value);
+    m_data = std::move(data);
+
+    mutate([this] { sys::setenv(m_data.c_str(), m_data.c_str() + m_key_size + 1); });
+    return *this;
+}
+
+// split_index
+
+split_index::split_index(string_view value, char sep) : m_value(value)
+{
+    if (value.size() >= std::numeric_limits<std::uint32_t>::max())
+        throw std::length_error("split_index: value is too long");
+
+    if (value.empty())
+        return;
+
+    for (size_t pos = value.find(sep); pos != string_view::npos; pos = value.find(sep, pos + 1))
+        m_ends.push_back(static_cast<std::uint32_t>(pos));
+
+    m_ends.push_back(static_cast<std::uint32_t>(value.size()));
+}
+
+split_index environment::variable::index(char sep) const &
+{
+    return split_index(value(), sep);
+}
+
+split_index environment::variable_ref::index(char sep) const
+{
+    return split_index(m_value, sep);
+}
+
+split_index pmr::variable::index(char sep) const &
+{
+    return split_index(value(), sep);
+}
+
+auto environment::begin_cursor() const -> cursor
+{
+    return cursor(sys::envp());
+}
+
+auto environment::end_cursor() const noexcept -> cursor
+{
+    return cursor(sys::envp() + entry_count());
+}
+
+auto environment::size() const noexcept -> size_type
+{
+    return entry_count();
+}
+
+auto environment_view::begin_cursor() const noexcept -> cursor
+{
+    return cursor(sys::envp());
+}
+
+auto environment_view::size() const noexcept -> size_type
+{
+    return entry_count();
+}
+
+auto environment::do_find(string_view k) const ->iterator
+{
+    return iterator(cursor(sys::find(k)));
+}
+
+auto environment::do_find(string_view k, size_t hash, bool static_key) const ->iterator
+{
+    if constexpr (SESSIONS_HOT_KEYS > 0)
+    {
+        auto const& e = cached_entry(k, hash, static_key);
+        return iterator(cursor(e.position.block + e.position.index));
+    }
+
+    return do_find(k);
+}
+
+bool environment::contains(string_view k) const
+{
+    return sys::contains(k);
+}
+
+void environment::do_erase(string_view k)
+{
+    mutate([k] { sys::rmenv(k); });
+}
+
+// batch
+
+namespace {
+
+bool valid_key(string_view key) noexcept
+{
+    return !key.empty() && key.find_first_of("=\0"sv) == string_view::npos;
+}
+
+// compares keys like the platform does, case insensitively on windows
+int compare_keys(string_view a, string_view b) noexcept
+{
+#if defined(WIN32)
+    return std::basic_string_view<char, ci_char_traits>(a.data(), a.size()).compare({ b.data(), b.size() });
+#else
+    return a.compare(b);
+#endif
+}
+
+} // unnamed namespace
+
+auto environment::batch::set(string_view key, string_view value) -> batch&
+{
+    auto const k = m_buffer.size();
+    m_buffer.append(key).append(1, '\0');
+    auto const v = m_buffer.size();
+    m_buffer.append(value).append(1, '\0');
+
+    m_changes.push_back(change{ k, key.size(), v, value.size() });
+    return *this;
+}
+
+auto environment::batch::erase(string_view key) -> batch&
+{
+    auto const k = m_buffer.size();
+    m_buffer.append(key).append(1, '\0');
+
+    m_changes.push_back(change{ k, key.size(), change::erased, 0 });
+    return *this;
+}
+
+void environment::batch::clear() noexcept
+{
+    m_buffer.clear();
+    m_changes.clear();
+}
+
+void environment::batch::reserve(size_t changes, size_t chars)
+{
+    // each key and value is null terminated
+    m_buffer.reserve(m_buffer.size() + chars + changes * 2);
+    m_changes.reserve(m_changes.size() + changes);
+}
+
+auto environment::batch::resolve() const -> std::vector<change const*>
+{
+    for (auto const& c : m_changes)
+    {
+        if (!valid_key(key(c)) || (!c.erases() && value(c).find('\0') != string_view::npos))
+            throw std::invalid_argument("invalid environment variable: '" + string(key(c)) + "'");
+    }
+
+    std::vector<change const*> sorted;
+    sorted.reserve(m_changes.size());
+    for (auto const& c : m_changes)
+        sorted.push_back(&c);
+
+    // changes to the same key end up next to each other, in the order they were made
+    std::stable_sort(sorted.begin(), sorted.end(), [this](change const* a, change const* b) {
+        return compare_keys(key(*a), key(*b)) < 0;
+    });
+
+    std::vector<bool> last(m_changes.size(), false);
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        if (i + 1 == sorted.size() || compare_keys(key(*sorted[i]), key(*sorted[i + 1])) != 0)
+            last[sorted[i] - m_changes.data()] = true;
+    }
+
+    std::vector<change const*> result;
+    result.reserve(sorted.size());
+    for (size_t i = 0; i < m_changes.size(); i++)
+    {
+        if (last[i])
+            result.push_back(&m_changes[i]);
+    }
+
+    return result;
+}
+
+void environment::batch::commit()
+{
+    auto const changes = resolve();
+
+    mutate([&] {
+        for (auto c : changes)
+        {
+            if (c->erases())
+                sys::rmenv(key(*c).data());
+            else
+                sys::setenv(key(*c).data(), value(*c).data());
+        }
+    });
+
+    clear();
+}
+
+// env_block
+
+env_block::env_block(environment::batch const& changes) : env_block(environment::snapshot{}, changes)
+{
+}
+
+env_block::env_block(environment::snapshot const& base, environment::batch const& changes)
+{
+    auto const sets = changes.resolve();
+    std::vector<bool> applied(sets.size(), false);
+
+    // indexes of the changes sorted by key, to look up the base's keys
+    std::vector<std::ptrdiff_t> by_key(sets.size());
+    std::iota(by_key.begin(), by_key.end(), 0);
+    std::sort(by_key.begin(), by_key.end(), [&](auto a, auto b) {
+        return compare_keys(changes.key(*sets[a]), changes.key(*sets[b])) < 0;
+    });
+
+    // index of the change to 'key', -1 if there's none
+    auto change_of = [&](string_view key) -> std::ptrdiff_t {
+        auto it = std::lower_bound(by_key.begin(), by_key.end(), key, [&](auto i, string_view k) {
+            return compare_keys(changes.key(*sets[i]), k) < 0;
+        });
+        return it != by_key.end() && compare_keys(changes.key(*sets[*it]), key) == 0 ? *it : -1;
+    };
+
+    // a base entry, or key=value from a set
+    struct line { string_view text, value; bool joined; };
+    std::vector<line> lines;
+    lines.reserve(base.size() + sets.size());
+
+    auto add_change = [&](std::ptrdiff_t i) {
+        applied[i] = true;
+        if (!sets[i]->erases())
+            lines.push_back(line{ changes.key(*sets[i]), changes.value(*sets[i]), true });
+    };
+
+    for (auto text : base)
+    {
+        auto const klen = key_length(text);
+        auto const i = klen == string_view::npos ? -1 : change_of(text.substr(0, klen));
+
+        if (i < 0)
+            lines.push_back(line{ text, {}, false });
+        else if (!applied[i])
+            add_change(i);
+    }
+
+    for (size_t i = 0; i < sets.size(); i++)
+    {
+        if (!applied[i])
+            add_change(i);
+    }
+
+#if defined(WIN32)
+    std::vector<wstring> wlines;
+    wlines.reserve(lines.size());
+    for (auto const& l : lines)
+        wlines.push_back(l.joined ? to_wide(l.text) + L'=' + to_wide(l.value) : to_wide(l.text));
+
+    auto length = [](wstring const& l) { return l.size(); };
+    auto write = [](wstring const& l, wchar_t* out) { return std::copy(l.begin(), l.end(), out); };
+    auto const& entries = wlines;
+#else
+    auto length = [](line const& l) { return l.text.size() + (l.joined ? l.value.size() + 1 : 0); };
+    auto write = [](line const& l, char* out) {
+        out = std::copy(l.text.begin(), l.text.end(), out);
+        if (l.joined) {
+            *out++ = '=';
+            out = std::copy(l.value.begin(), l.value.end(), out);
+        }
+        return out;
+    };
+    auto const& entries = lines;
+#endif
+
+    // the pointer array, followed by the strings
+    size_t chars = 0;
+    for (auto const& e : entries)
+        chars += length(e) + 1;
+
+    auto const ptrs = entries.size() + 1;
+    auto const ptr_size = sizeof(detail::envchar*);
+    m_storage.reset(new detail::envchar*[ptrs + (chars * sizeof(detail::envchar) + ptr_size - 1) / ptr_size]);
+    m_size = entries.size();
+
+    auto out = reinterpret_cast<detail::envchar*>(m_storage.get() + ptrs);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        m_storage[i] = out;
+        out = write(entries[i], out);
+        *out++ = 0;
+    }
+    m_storage[entries.size()] = nullptr;
+}
+
+// env files
+
+env_file_error::env_file_error(size_t line, string const& what)
+    : std::runtime_error("line " + std::to_string(line) + ": " + what), m_line(line)
+{
+}
+
+namespace {
+
+bool is_blank(char c) noexcept
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// chars that end a key: '=', '#', newlines and blanks
+constexpr auto key_stops = [] {
+    std::array<bool, 256> stops{};
+    for (unsigned char c : "=#\n \t\r"sv)
+        stops[c] = true;
+    return stops;
+}();
+
+// parses 'text' in a single pass, values without escapes are passed to the batch as views into 'text'
+void parse_env_into(string_view text, environment::batch& out)
+{
+    auto p = text.data();
+    auto const end = p + text.size();
+    size_t line = 1;
+    string unescaped;
+
+    auto skip_blanks = [&] {
+        while (p != end && is_blank(*p)) ++p;
+    };
+    auto line_end = [&] {
+        auto const nl = static_cast<char const*>(std::memchr(p, '\n', end - p));
+        return nl ? nl : end;
+    };
+    auto count_lines = [](char const* first, char const* last) {
+        size_t n = 0;
+        while ((first = static_cast<char const*>(std::memchr(first, '\n', last - first)))) {
+            ++first;
+            ++n;
+        }
+        return n;
+    };
+
+    // an empty mapped file has no data pointer
+    if (text.empty())
+        return;
+
+    // one change per line at most, keys and values are never longer than the text
+    out.reserve(count_lines(p, end) + 1, text.size());
+
+    if (text.substr(0, 3) == "\xEF\xBB\xBF"sv)
+        p += 3;
+
+    while (p != end)
+    {
+        skip_blanks();
+        if (p == end)
+            break;
+
+        if (*p == '\n' || *p == '#') {
+            p = line_end();
+            if (p != end) ++p;
+            line++;
+            continue;
+        }
+
+        if (end - p > 6 && string_view(p, 6) == "export"sv && is_blank(p[6])) {
+            p += 6;
+            skip_blanks();
+        }
+
+        auto const key_begin = p;
+        while (p != end && !key_stops[static_cast<unsigned char>(*p)])
+            ++p;
+        auto const key = string_view(key_begin, p - key_begin);
+
+        skip_blanks();
+        if (key.empty())
+            throw env_file_error(line, "expected a key");
+        if (p == end || *p != '=')
+            throw env_file_error(line, "expected '=' after '" + string(key) + "'");
+
+        ++p;
+        skip_blanks();
+
+        string_view value;
+        auto const value_line = line;
+
+        if (p != end && *p == '\'')
+        {
+            auto const close = static_cast<char const*>(std::memchr(p + 1, '\'', end - p - 1));
+            if (!close)
+                throw env_file_error(value_line, "unterminated quote in the value of '" + string(key) + "'");
+
+            value = string_view(p + 1, close - p - 1);
+            line += count_lines(p, close);
+            p = close + 1;
+        }
+        else if (p != end && *p == '"')
+        {
+            auto q = ++p;
+            while (q != end && *q != '"' && *q != '\\')
+                ++q;
+
+            if (q != end && *q == '"') {
+                value = string_view(p, q - p);
+            }
+            else {
+                unescaped.assign(p, q);
+                for (; q != end && *q != '"'; ++q)
+                {
+                    if (*q != '\\' || q + 1 == end) {
+                        unescaped += *q;
+                        continue;
+                    }
+
+                    switch (*++q)
+                    {
+                    case 'n': unescaped += '\n'; break;
+                    case 'r': unescaped += '\r'; break;
+                    case 't': unescaped += '\t'; break;
+                    case '"': case '\\': case '$': unescaped += *q; break;
+                    default: unescaped += '\\'; unescaped += *q; break;
+                    }
+                }
+                value = unescaped;
+            }
+
+            if (q == end)
+                throw env_file_error(value_line, "unterminated quote in the value of '" + string(key) + "'");
+
+            line += count_lines(p, q);
+            p = q + 1;
+        }
+        else
+        {
+            auto const eol = line_end();
+
+            // a '#' after whitespace starts a comment
+            auto stop = eol;
+            for (auto q = p; q != eol;)
+            {
+                auto const hash = static_cast<char const*>(std::memchr(q, '#', eol - q));
+                if (!hash)
+                    break;
+                if (hash != p && is_blank(hash[-1])) {
+                    stop = hash;
+                    break;
+                }
+                q = hash + 1;
+            }
+            while (stop != p && is_blank(stop[-1]))
+                --stop;
+
+            value = string_view(p, stop - p);
+            p = eol;
+        }
+
+        // after a quoted value only whitespace and a comment may follow
+        skip_blanks();
+        if (p != end && *p == '#')
+            p = line_end();
+        if (p != end && *p != '\n')
+            throw env_file_error(line, "unexpected characters after the value of '" + string(key) + "'");
+
+        out.set(key, value);
+
+        if (p != end) {
+            ++p;
+            line++;
+        }
+    }
+}
+
+} // unnamed namespace
+
+environment::batch parse_env(string_view text)
+{
+    environment::batch changes;
+    parse_env_into(text, changes);
+    return changes;
+}
+
+environment::batch load_env_file(string const& path)
+{
+    sys::mapped_file const file{ path };
+    return parse_env(file.data());
+}
+
+// write_to
+
+namespace {
+
+// gathers the output of write_to, short pieces are copied into a buffer so they're written together,
+// long ones are written from where they are and have to stay valid until the next flush
+class env_writer
+{
+public:
+    static constexpr size_t buffer_size = 64 * 1024;
+    static constexpr size_t max_chunks = 1024;
+#if defined(WIN32)
+    static constexpr size_t in_place_size = size_t(-1); // narrowed entries don't outlive the loop
+#else
+    static constexpr size_t in_place_size = 256;
+#endif
+
+    explicit env_writer(int fd) : m_fd(fd), m_buffer(new char[buffer_size])
+    {
+        m_chunks.reserve(max_chunks + 1);
+    }
+
+    void put(string_view text)
+    {
+        if (text.size() < in_place_size && text.size() <= buffer_size - m_used) {
+            std::memcpy(m_buffer.get() + m_used, text.data(), text.size());
+            m_used += text.size();
+        }
+        else
+            put_slow(text);
+    }
+
+    /* 'text', with the chars escape() replaces replaced, find(text, pos) returns the position of
+       the first of them at 'pos' or past it, or npos
+    */
+    template <class Find, class Escape>
+    void put_escaped(string_view text, Find&& find, Escape&& escape)
+    {
+        size_t run = 0;
+        for (auto i = find(text, 0); i != string_view::npos; i = find(text, i + 1))
+        {
+            put(text.substr(run, i - run));
+            put(escape(text[i]));
+            run = i + 1;
+        }
+        put(text.substr(run));
+    }
+
+    void flush()
+    {
+        end_run();
+        sys::write_all(m_fd, m_chunks.data(), m_chunks.size());
+        m_chunks.clear();
+        m_used = m_run = 0;
+    }
+
+private:
+    void put_slow(string_view text)
+    {
+        if (text.size() >= in_place_size)
+        {
+            end_run();
+            m_chunks.push_back(text);
+            if (m_chunks.size() >= max_chunks)
+                flush();
+            return;
+        }
+
+        while (!text.empty())
+        {
+            if (m_used == buffer_size)
+                flush();
+
+            auto const n = std::min(text.size(), buffer_size - m_used);
+            std::memcpy(m_buffer.get() + m_used, text.data(), n);
+            m_used += n;
+            text.remove_prefix(n);
+        }
+    }
+
+    // what was copied since the last chunk becomes a chunk
+    void end_run()
+    {
+        if (m_used > m_run)
+            m_chunks.emplace_back(m_buffer.get() + m_run, m_used - m_run);
+        m_run = m_used;
+    }
+
+    int m_fd;
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_used = 0, m_run = 0; // the buffer's size, and where the bytes that aren't in a chunk yet start
+    std::vector<string_view> m_chunks;
+};
+
+// shell variable names, [A-Za-z_][A-Za-z0-9_]*
+bool shell_name(string_view key) noexcept
+{
+    static constexpr auto word = [] {
+        std::array<bool, 256> table{};
+        for (int c = 0; c < 256; c++)
+            table[c] = c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+        return table;
+    }();
+
+    if (key.empty() || (key[0] >= '0' && key[0] <= '9'))
+        return false;
+
+    bool valid = true;
+    for (char c : key)
+        valid &= word[static_cast<unsigned char>(c)]; // no early exit, so it's vectorized
+    return valid;
+}
+
+size_t find_quote(string_view text, size_t pos) noexcept
+{
+    return text.find('\'', pos);
+}
+
+// closes the quote, writes an escaped quote and opens it again
+string_view shell_escape(char) noexcept
+{
+    return "'\\''"sv;
+}
+
+// the first '"', '\\' or control char at 'pos' or past it, 8 bytes at a time
+size_t find_json_special(string_view text, size_t pos) noexcept
+{
+    constexpr std::uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+    auto const special = [](unsigned char c) { return c < 0x20 || c == '"' || c == '\\'; };
+
+    for (; pos + 8 <= text.size(); pos += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, text.data() + pos, 8);
+
+        // a high bit is set for each byte that's below 0x20 or equals one of the chars, bytes past ASCII never match
+        auto const below = (word - ones * 0x20) & ~word;
+        auto const quote = word ^ (ones * '"'), backslash = word ^ (ones * '\\');
+        auto const equal = ((quote - ones) & ~quote) | ((backslash - ones) & ~backslash);
+        if ((below | equal) & highs)
+            break;
+    }
+
+    for (; pos < text.size(); pos++) {
+        if (special(static_cast<unsigned char>(text[pos])))
+            return pos;
+    }
+    return string_view::npos;
+}
+
+// 'c' is a char find_json_special finds
+string_view json_escape(char c) noexcept
+{
+    // \u00XX for each control char
+    static constexpr auto controls = [] {
+        std::array<char[7], 32> table{};
+        constexpr char hex[] = "0123456789abcdef";
+        for (size_t i = 0; i < table.size(); i++) {
+            char const escaped[7] = { '\\', 'u', '0', '0', hex[i >> 4], hex[i & 15], '\0' };
+            for (size_t j = 0; j < 7; j++)
+                table[i][j] = escaped[j];
+        }
+        return table;
+    }();
+
+    switch (c)
+    {
+    case '"': return "\\\""sv;
+    case '\\': return "\\\\"sv;
+    case '\n': return "\\n"sv;
+    case '\r': return "\\r"sv;
+    case '\t': return "\\t"sv;
+    case '\b': return "\\b"sv;
+    case '\f': return "\\f"sv;
+    default: // only control chars are left
+        return string_view(controls[static_cast<unsigned char>(c)], 6);
+    }
+}
+
+// writes one key=value 'line', 'first' is true for the first entry
+void write_entry(env_writer& out, string_view line, environment::format fmt, bool& first)
+{
+    using format = environment::format;
+
+    // entries are null terminated in the block, and in narrowed strings
+    if (fmt == format::nul) {
+        out.put({ line.data(), line.size() + 1 });
+        return;
+    }
+
+    auto const klen = key_length(line);
+    if (klen == string_view::npos)
+        return;
+
+    auto const key = line.substr(0, klen), value = line.substr(klen + 1);
+    if (fmt == format::shell)
+    {
+        if (!shell_name(key))
+            return;
+
+        out.put("export "sv);
+        out.put(key);
+        out.put("='"sv);
+        out.put_escaped(value, find_quote, shell_escape);
+        out.put("'\n"sv);
+    }
+    else
+    {
+        out.put(first ? "{\""sv : ",\""sv);
+        out.put_escaped(key, find_json_special, json_escape);
+        out.put("\":\""sv);
+        out.put_escaped(value, find_json_special, json_escape);
+        out.put("\""sv);
+    }
+    first = false;
+}
+
+} // unnamed namespace
+
+void environment::write_to(int fd, format fmt) const
+{
+    env_writer out{ fd };
+    bool first = true;
+
+#if defined(WIN32)
+    for (auto const& line : *this)
+        write_entry(out, line, fmt, first);
+#else
+    for (auto p = sys::envp(); p && *p; ++p)
+        write_entry(out, *p, fmt, first);
+#endif
+
+    if (fmt == format::json)
+        out.put(first ? "{}\n"sv : "}\n"sv);
+
+    out.flush();
+}
+
+void environment::enable_store()
+{
+    auto& st = store();
+    std::lock_guard<std::mutex> lock{ st.writer };
+
+    if (!st.current.load())
+        st.publish();
+}
+
+auto environment::pin() -> pinned
+{
+    if (!store().current.load())
+        enable_store();
+
+    return pinned(thread_slot());
+}
+
+environment::pinned::pinned(detail::reader_slot* slot) noexcept : m_slot(slot)
+{
+    auto& st = store();
+    if (m_slot->depth++ == 0)
+        m_slot->epoch.store(st.epoch.load());
+
+    m_snap = st.current.load();
+}
+
+environment::pinned::~pinned()
+{
+    if (--m_slot->depth == 0)
+        m_slot->epoch.store(detail::reader_slot::idle);
+}
+
+// executable_cache
+
+namespace {
+
+#if defined(WIN32)
+constexpr auto dir_separators = "\\/"sv;
+#else
+constexpr auto dir_separators = "/"sv;
+#endif
+
+// directories that don't depend on the current directory
+bool absolute_dir(string_view dir) noexcept
+{
+#if defined(WIN32)
+    return (dir.size() >= 3 && dir[1] == ':' && dir_separators.find(dir[2]) != string_view::npos) ||
+        (dir.size() >= 2 && dir_separators.find(dir[0]) != string_view::npos && dir_separators.find(dir[1]) != string_view::npos);
+#else
+    return !dir.empty() && dir.front() == '/';
+#endif
+}
+
+// names are matched case insensitively on windows
+void index_key(string_view name, string& key)
+{
+    key.assign(name.data(), name.size());
+#if defined(WIN32)
+    for (auto& c : key)
+    {
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+    }
+#endif
+}
+
+} // unnamed namespace
+
+struct executable_cache::impl
+{
+    using clock = std::chrono::steady_clock;
+
+    // relative directories aren't indexed, they're searched on each lookup since the current directory may change
+    struct directory
+    {
+        string path;
+        std::int64_t mtime;
+        bool relative;
+    };
+
+    // a file in one of the directories, files with the same key are chained in PATH order
+    struct candidate
+    {
+        static constexpr auto none = std::numeric_limits<std::uint32_t>::max();
+        enum state : unsigned char { unknown, executable, other };
+
+        string file;
+        std::uint32_t dir;
+        std::uint32_t next = none;
+        state status = unknown;    // checked on the first lookup
+        std::uint32_t checked = 0; // the status_epoch it was checked in, permissions don't change the directory's mtime
+    };
+
+    explicit impl(std::chrono::milliseconds r) : recheck(r) {}
+
+    std::mutex mutex;
+    std::chrono::milliseconds recheck;
+    clock::time_point checked;
+    std::uint32_t status_epoch = 0; // bumped each 'recheck' interval, older statuses are checked again
+    bool built = false;
+
+    string path, pathext;
+    env_position path_position, pathext_position; // PATH and PATHEXT are only read again when these change
+    std::vector<directory> dirs;
+    std::vector<std::uint32_t> relative_dirs;
+    std::vector<candidate> candidates;
+    std::unordered_map<string, std::uint32_t> index; // key -> its first candidate
+    std::vector<string> extensions; // [WINDOWS] from PATHEXT
+    string key; // lookup key, reused to avoid allocations
+
+    // rebuilds the index if PATH, PATHEXT or any directory changed, must hold 'mutex'
+    void validate();
+    void rebuild(string_view path_value, string_view pathext_value);
+
+    std::optional<string> find(string_view name);
+
+    // first executable candidate for 'key', or candidate::none
+    std::uint32_t find_candidate(string const& key);
+
+    // 'name' in the relative directories before 'before'
+    std::optional<string> find_relative(string_view name, size_t before) const;
+
+    string full_path(candidate const& c) const;
+};
+
+void executable_cache::impl::validate()
+{
+    auto const gen = generation.load();
+#if defined(WIN32)
+    auto const moved = !path_position.current(gen) || !pathext_position.current(gen);
+#else
+    auto const moved = !path_position.current(gen);
+#endif
+
+    if (!built || moved)
+    {
+        auto const found = sys::find("PATH");
+        path_position.update(found, gen);
+#if defined(WIN32)
+        string buffer, extbuffer;
+        auto const current = sys::getenv("PATH", buffer).value_or(string_view{});
+        pathext_position.update(sys::find("PATHEXT"), gen);
+        auto const ext = sys::getenv("PATHEXT", extbuffer).value_or(string_view{});
+#else
+        auto const current = *found ? string_view(*found + 5) : string_view{};
+        auto const ext = string_view{};
+#endif
+
+        if (!built || current != path || ext != pathext)
+            return rebuild(current, ext);
+    }
+
+    auto const now = clock::now();
+    if (now - checked < recheck)
+        return;
+
+    checked = now;
+    status_epoch++;
+    auto const changed = std::any_of(dirs.begin(), dirs.end(), [](directory const& d) {
+        return !d.relative && sys::mtime(d.path) != d.mtime;
+    });
+
+    if (changed)
+        rebuild(path, pathext);
+}
+
+void executable_cache::impl::rebuild(string_view path_value, string_view pathext_value)
+{
+    path.assign(path_value.data(), path_value.size());
+    pathext.assign(pathext_value.data(), pathext_value.size());
+    dirs.clear();
+    relative_dirs.clear();
+    candidates.clear();
+    index.clear();
+    extensions.clear();
+
+    for (size_t pos = 0; pos < path.size();)
+    {
+        auto const end = std::min(path.find(environment::path_separator, pos), path.size());
+        auto dir = string_view(path).substr(pos, end - pos);
+        pos = end + 1;
+
+#if defined(WIN32)
+        if (dir.size() >= 2 && dir.front() == '"' && dir.back() == '"')
+            dir = dir.substr(1, dir.size() - 2);
+        if (dir.empty())
+            continue;
+#else
+        if (dir.empty())
+            dir = "."; // an empty entry is the current directory
+#endif
+
+        auto const seen = std::any_of(dirs.begin(), dirs.end(), [dir](directory const& d) { return d.path == dir; });
+        if (seen)
+            continue;
+
+        if (!absolute_dir(dir)) {
+            relative_dirs.push_back(static_cast<std::uint32_t>(dirs.size()));
+            dirs.push_back(directory{ string(dir), 0, true });
+            continue;
+        }
+
+        auto const d = static_cast<std::uint32_t>(dirs.size());
+        string dirpath{ dir };
+        auto const mtime = sys::mtime(dirpath); // before listing, so changes made meanwhile are caught
+        dirs.push_back(directory{ std::move(dirpath), mtime, false });
+
+        for (auto& file : sys::listdir(dirs.back().path))
+        {
+            index_key(file, key);
+            auto const c = static_cast<std::uint32_t>(candidates.size());
+            candidates.push_back(candidate{ std::move(file), d });
+
+            auto [it, inserted] = index.try_emplace(key, c);
+            if (!inserted)
+            {
+                auto last = it->second;
+                while (candidates[last].next != candidate::none)
+                    last = candidates[last].next;
+                candidates[last].next = c;
+            }
+        }
+    }
+
+#if defined(WIN32)
+    for (size_t pos = 0; pos < pathext.size();)
+    {
+        auto const end = std::min(pathext.find(';', pos), pathext.size());
+        if (end > pos) {
+            extensions.emplace_back();
+            index_key(string_view(pathext).substr(pos, end - pos), extensions.back());
+        }
+        pos = end + 1;
+    }
+#endif
+
+    built = true;
+    checked = clock::now();
+}
+
+std::uint32_t executable_cache::impl::find_candidate(string const& k)
+{
+    auto it = index.find(k);
+    if (it == index.end())
+        return candidate::none;
+
+    for (auto c = it->second; c != candidate::none; c = candidates[c].next)
+    {
+        auto& cand = candidates[c];
+        if (cand.status == candidate::unknown || cand.checked != status_epoch) {
+            cand.status = sys::executable(full_path(cand)) ? candidate::executable : candidate::other;
+            cand.checked = status_epoch;
+        }
+
+        if (cand.status == candidate::executable)
+            return c;
+    }
+
+    return candidate::none;
+}
+
+namespace {
+
+string join_dir(string_view dir, string_view file)
+{
+    string result;
+    result.reserve(dir.size() + file.size() + 1);
+    result += dir;
+    if (dir_separators.find(dir.back()) == string_view::npos)
+        result += dir_separators.front();
+    result += file;
+    return result;
+}
+
+} // unnamed namespace
+
+string executable_cache::impl::full_path(candidate const& c) const
+{
+    return join_dir(dirs[c.dir].path, c.file);
+}
+
+std::optional<string> executable_cache::impl::find_relative(string_view name, size_t before) const
+{
+    for (auto const d : relative_dirs)
+    {
+        if (d >= before)
+            break;
+
+#if defined(WIN32)
+        if (name.find('.') == string_view::npos)
+        {
+            for (auto const& ext : extensions)
+            {
+                auto file = join_dir(dirs[d].path, name);
+                file += ext;
+                if (sys::executable(file))
+                    return file;
+            }
+            continue;
+        }
+#endif
+        auto file = join_dir(dirs[d].path, name);
+        if (sys::executable(file))
+            return file;
+    }
+
+    return std::nullopt;
+}
+
+std::optional<string> executable_cache::impl::find(string_view name)
+{
+    if (name.empty())
+        return std::nullopt;
+
+    if (name.find_first_of(dir_separators) != string_view::npos)
+    {
+        string file{ name };
+        return sys::executable(file) ? std::optional<string>(std::move(file)) : std::nullopt;
+    }
+
+    index_key(name, key);
+    auto best = candidate::none;
+
+#if defined(WIN32)
+    // like CreateProcess, names without an extension are tried with each one in PATHEXT,
+    // directories earlier in PATH win over extensions earlier in PATHEXT
+    if (name.find('.') == string_view::npos)
+    {
+        auto const base = key.size();
+        for (auto const& ext : extensions)
+        {
+            key.resize(base);
+            key += ext;
+            auto const c = find_candidate(key);
+            if (c != candidate::none && (best == candidate::none || candidates[c].dir < candidates[best].dir))
+                best = c;
+        }
+    }
+    else
+        best = find_candidate(key);
+#else
+    best = find_candidate(key);
+#endif
+
+    if (auto found = find_relative(name, best == candidate::none ? dirs.size() : candidates[best].dir))
+        return found;
+
+    if (best == candidate::none)
+        return std::nullopt;
+
+    return full_path(candidates[best]);
+}
+
+executable_cache::executable_cache(std::chrono::milliseconds recheck) : m_impl(std::make_unique<impl>(recheck))
+{
+}
+
+executable_cache::~executable_cache() = default;
+
+std::optional<string> executable_cache::find(string_view name)
+{
+    std::lock_guard<std::mutex> lock{ m_impl->mutex };
+    m_impl->validate();
+    return m_impl->find(name);
+}
+
+auto executable_cache::find(std::vector<string_view> const& names) -> std::vector<std::optional<string>>
+{
+    std::lock_guard<std::mutex> lock{ m_impl->mutex };
+    m_impl->validate();
+
+    std::vector<std::optional<string>> results;
+    results.reserve(names.size());
+    for (auto name : names)
+        results.push_back(m_impl->find(name));
+
+    return results;
+}
+
+void executable_cache::clear()
+{
+    std::lock_guard<std::mutex> lock{ m_impl->mutex };
+    m_impl->built = false;
+    m_impl->dirs.clear();
+    m_impl->relative_dirs.clear();
+    m_impl->candidates.clear();
+    m_impl->index.clear();
+}
+
+namespace {
+
+executable_cache& shared_executables()
+{
+    static executable_cache instance;
+    return instance;
+}
+
+} // unnamed namespace
+
+std::optional<string> find_executable(string_view name)
+{
+    return shared_executables().find(name);
+}
+
+std::vector<std::optional<string>> find_executables(std::vector<string_view> const& names)
+{
+    return shared_executables().find(names);
+}
+
+// snapshot
+
+namespace {
+
+// builds the hash index over table.lines, when a key appears more than once the first entry wins
+void index_table(detail::env_table& table)
+{
+    using slot = detail::env_table::slot;
+
+    size_t capacity = 2;
+    while (capacity < table.lines.size() * 2)
+        capacity *= 2;
+
+    table.slots.assign(capacity, slot{0, 0});
+    auto const mask = capacity - 1;
+
+    for (size_t i = 0; i < table.lines.size(); i++)
+    {
+        auto const line = table.lines[i];
+        auto const klen = key_length(line);
+        if (klen == string_view::npos)
+            continue;
+
+        auto const key = line.substr(0, klen);
+        auto const h = detail::hash_key(key);
+        auto pos = h & mask;
+        bool duplicate = false;
+
+        for (; table.slots[pos].index != 0; pos = (pos + 1) & mask)
+        {
+            auto& s = table.slots[pos];
+            if (s.hash == static_cast<std::uint32_t>(h) && key_equals(table.lines[s.index - 1], key)) {
+                duplicate = true;
+                break;
+            }
+        }
+
+        if (!duplicate)
+            table.slots[pos] = slot{ static_cast<std::uint32_t>(h), static_cast<std::uint32_t>(i + 1) };
+    }
+}
+
+// FNV-1a over the entry pointers, changing any of them changes the hash
+void add_entry(detail::env_token& token, detail::envchar const* entry) noexcept
+{
+    token.hash ^= reinterpret_cast<std::uintptr_t>(entry);
+    token.hash *= 1099511628211ull;
+    token.count++;
+}
+
+detail::env_token block_token(sys::envblock block) noexcept
+{
+    detail::env_token token{ block, 0, 14695981039346656037ull };
+    for (auto p = block; p && *p; ++p)
+        add_entry(token, *p);
+    return token;
+}
+
+// copies an environment block in a single pass, each line is kept null terminated inside the arena.
+// everything, including the shared_ptr's control block, is allocated from 'mr'
+auto make_table(sys::envblock block, std::pmr::memory_resource* mr)
+{
+    auto table = std::allocate_shared<detail::env_table>(std::pmr::polymorphic_allocator<detail::env_table>(mr), mr);
+    std::pmr::vector<size_t> offsets{ mr };
+    table->token = detail::env_token{ block, 0, 14695981039346656037ull };
+
+    for (auto p = block; p && *p; ++p)
+    {
+        add_entry(table->token, *p);
+        offsets.push_back(table->arena.size());
+#if defined(WIN32)
+        table->arena += detail::pmr_narrow_copy(*p, mr);
+#else
+        table->arena += *p;
+#endif
+        table->arena += '\0';
+    }
+    offsets.push_back(table->arena.size());
+
+    table->lines.reserve(offsets.size() - 1);
+    for (size_t i = 0; i + 1 < offsets.size(); i++) {
+        table->lines.emplace_back(table->arena.data() + offsets[i], offsets[i + 1] - offsets[i] - 1);
+    }
+
+    index_table(*table);
+    return std::shared_ptr<const detail::env_table>(std::move(table));
+}
+
+} // unnamed namespace
+
+environment::snapshot::snapshot() : snapshot(std::pmr::get_default_resource())
+{
+}
+
+environment::snapshot::snapshot(std::pmr::memory_resource* mr) : m_table(make_table(sys::envp(), mr))
+{
+}
+
+environment::snapshot::snapshot(batch const& changes, std::pmr::memory_resource* mr)
+{
+    auto sets = changes.resolve();
+    std::sort(sets.begin(), sets.end(), [&](auto a, auto b) { return changes.key(*a) < changes.key(*b); });
+
+    auto table = std::allocate_shared<detail::env_table>(std::pmr::polymorphic_allocator<detail::env_table>(mr), mr);
+
+    size_t chars = 0;
+    for (auto c : sets)
+        chars += c->key_size + c->value_size + 2;
+    table->arena.reserve(chars);
+    table->lines.reserve(sets.size());
+
+    // the arena doesn't grow past its reserved size, so views into it stay valid
+    for (auto c : sets)
+    {
+        if (c->erases())
+            continue;
+
+        auto const offset = table->arena.size();
+        table->arena.append(changes.key(*c)).append(1, '=').append(changes.value(*c)).append(1, '\0');
+        table->lines.emplace_back(table->arena.data() + offset, table->arena.size() - offset - 1);
+    }
+
+    index_table(*table);
+    m_table = std::move(table);
+}
+
+auto environment::snapshot::find(string_view key) const noexcept -> iterator
+{
+    return find(key, detail::hash_key(key));
+}
+
+auto environment::snapshot::find(string_view key, size_t h) const noexcept -> iterator
+{
+    auto const& slots = m_table->slots;
+    auto const mask = slots.size() - 1;
+
+    for (auto pos = h & mask; slots[pos].index != 0; pos = (pos + 1) & mask)
+    {
+        auto const& s = slots[pos];
+        if (s.hash == static_cast<std::uint32_t>(h) && key_equals(m_table->lines[s.index - 1], key))
+            return begin() + (s.index - 1);
+    }
+
+    return end();
+}
+
+string_view environment::snapshot::operator[] (string_view key) const noexcept
+{
+    auto it = find(key);
+    return it != end() ? it->substr(key.size() + 1) : string_view{};
+}
+
+auto environment::token() noexcept -> change_token
+{
+    return block_token(sys::envp());
+}
+
+// ci_index
+
+namespace {
+
+// 'line' is key=value with a key equal to 'key' when folded
+bool key_iequals(string_view line, string_view key) noexcept
+{
+    return
+        line.length() > key.length() &&
+        line[key.length()] == '=' &&
+        detail::ascii_iequals(line.substr(0, key.length()), key);
+}
+
+} // unnamed namespace
+
+ci_index::ci_index(environment::snapshot snap, policy p) : m_snap(std::move(snap)), m_policy(p)
+{
+    size_t capacity = 2;
+    while (capacity < m_snap.size() * 2)
+        capacity *= 2;
+
+    m_slots.assign(capacity, slot{ 0, 0, 0 });
+    auto const mask = capacity - 1;
+    auto const lines = m_snap.begin();
+
+    for (size_t i = 0; i < m_snap.size(); i++)
+    {
+        auto const klen = key_length(lines[i]);
+        if (klen == string_view::npos)
+            continue;
+
+        auto const key = lines[i].substr(0, klen);
+        auto const h = detail::hash_key_ci(key);
+        auto pos = h & mask;
+
+        for (; m_slots[pos].index != 0; pos = (pos + 1) & mask)
+        {
+            auto const& s = m_slots[pos];
+            if (s.hash == static_cast<std::uint32_t>(h) && key_iequals(lines[s.index - 1], key))
+                break;
+        }
+
+        auto& s = m_slots[pos];
+        if (s.index == 0)
+            s = slot{ static_cast<std::uint32_t>(h), static_cast<std::uint32_t>(i + 1), 0 };
+        else if (!key_equals(lines[s.index - 1], key))
+            s.ambiguous = 1; // repeats of the same key aren't ambiguous, the first one wins like in the snapshot
+    }
+}
+
+auto ci_index::find_slot(string_view key) const noexcept -> slot const*
+{
+    auto const h = detail::hash_key_ci(key);
+    auto const mask = m_slots.size() - 1;
+    auto const lines = m_snap.begin();
+
+    for (auto pos = h & mask; m_slots[pos].index != 0; pos = (pos + 1) & mask)
+    {
+        auto const& s = m_slots[pos];
+        if (s.hash == static_cast<std::uint32_t>(h) && key_iequals(lines[s.index - 1], key))
+            return &s;
+    }
+
+    return nullptr;
+}
+
+auto ci_index::find(string_view key) const noexcept -> iterator
+{
+    auto const s = find_slot(key);
+    if (!s)
+        return end();
+
+    auto const first = m_snap.begin() + (s->index - 1);
+    if (!s->ambiguous)
+        return first;
+
+    switch (m_policy)
+    {
+    case policy::exact_first: {
+        auto const exact = m_snap.find(key);
+        return exact != end() ? exact : first;
+    }
+    case policy::first:
+        return first;
+    case policy::reject:
+    default:
+        return end();
+    }
+}
+
+string_view ci_index::operator[] (string_view key) const noexcept
+{
+    auto it = find(key);
+    return it != end() ? it->substr(key.size() + 1) : string_view{};
+}
+
+bool ci_index::ambiguous(string_view key) const noexcept
+{
+    auto const s = find_slot(key);
+    return s && s->ambiguous;
+}
+
+// key_index
+
+key_index::key_index(environment::snapshot snap)
+{
+    auto index = std::make_shared<data>(data{ std::move(snap), {} });
+    auto const lines = index->snap.begin();
+    auto& entries = index->entries;
+
+    entries.reserve(index->snap.size());
+    for (size_t i = 0; i < index->snap.size(); i++)
+    {
+        auto const klen = key_length(lines[i]);
+        if (klen != string_view::npos)
+            entries.push_back(entry{ static_cast<std::uint32_t>(i), static_cast<std::uint32_t>(klen) });
+    }
+
+    // stable, so repeated keys stay in block order
+    std::stable_sort(entries.begin(), entries.end(), [lines](entry const& a, entry const& b) {
+        return lines[a.line].substr(0, a.key_size) < lines[b.line].substr(0, b.key_size);
+    });
+
+    m_data = std::move(index);
+}
+
+size_t key_index::lower_bound(string_view key) const noexcept
+{
+    auto const& entries = m_data->entries;
+    auto const lines = m_data->snap.begin();
+
+    auto const it = std::lower_bound(entries.begin(), entries.end(), key, [lines](entry const& e, string_view k) {
+        return lines[e.line].substr(0, e.key_size) < k;
+    });
+    return static_cast<size_t>(it - entries.begin());
+}
+
+auto key_index::with_prefix(string_view prefix) const -> sorted_range
+{
+    auto const& entries = m_data->entries;
+    auto const lines = m_data->snap.begin();
+    auto const first = lower_bound(prefix);
+
+    // keys starting with 'prefix' are the ones right after its lower bound
+    auto const last = std::partition_point(entries.begin() + first, entries.end(), [&](entry const& e) {
+        return e.key_size >= prefix.size() && lines[e.line].compare(0, prefix.size(), prefix) == 0;
+    });
+    return { m_data, first, static_cast<size_t>(last - entries.begin()) };
+}
+
+auto key_index::range(string_view first, string_view last) const -> sorted_range
+{
+    auto const begin = lower_bound(first);
+    return { m_data, begin, std::max(begin, lower_bound(last)) };
+}
+
+namespace {
+
+// the calling thread's key_index of the environment, and what it was checked against
+struct sorted_keys_cache
+{
+    std::optional<key_index> keys;
+    std::uint64_t generation = ~std::uint64_t(0);
+    sys::envblock block = nullptr;
+    size_t count = 0;
+    sys::envchar const* last = nullptr;
+};
+
+thread_local sorted_keys_cache sorted_keys_of_thread;
+
+} // unnamed namespace
+
+key_index environment::sorted_keys()
+{
+    auto& c = sorted_keys_of_thread;
+    auto const gen = generation.load();
+    auto const block = sys::envp();
+    auto const count = entry_count();
+    auto const last = count ? block[count - 1] : nullptr;
+
+    // a moved or resized block settles it, the O(n) token is only compared after the library changed the environment
+    auto const same_block = c.keys && c.block == block && c.count == count && c.last == last;
+    if (!same_block || (c.generation != gen && has_changed_since(c.keys->snapshot().token())))
+        c.keys.emplace(snapshot{});
+
+    c.generation = gen;
+    c.block = block;
+    c.count = count;
+    c.last = last;
+    return *c.keys;
+}
+
+void environment::drop_sorted_keys() noexcept
+{
+    sorted_keys_of_thread = sorted_keys_cache{};
+}
+
+// diff
+
+env_diff diff(environment::snapshot const& a, environment::snapshot const& b)
+{
+    env_diff result;
+
+    // copies share their storage
+    if (a.size() == b.size() && (a.empty() || a.begin()->data() == b.begin()->data()))
+        return result;
+
+    // calls fn(key, value, other's value) for each entry of 'from' that its lookups find
+    auto compare = [](environment::snapshot const& from, environment::snapshot const& other, auto fn) {
+        for (auto line : from)
+        {
+            auto const klen = key_length(line);
+            if (klen == string_view::npos)
+                continue;
+
+            auto const key = line.substr(0, klen);
+            if (from.find(key)->data() != line.data())
+                continue;
+
+            auto const it = other.find(key);
+            fn(key, line.substr(klen + 1), it != other.end() ? std::optional<string_view>(it->substr(klen + 1)) : std::nullopt);
+        }
+    };
+
+    compare(a, b, [&](string_view key, string_view value, std::optional<string_view> other) {
+        if (!other)
+            result.removed.emplace_back(key, value);
+        else if (*other != value)
+            result.changed.push_back(env_diff::change{ key, value, *other });
+    });
+    compare(b, a, [&](string_view key, string_view value, std::optional<string_view> other) {
+        if (!other)
+            result.added.emplace_back(key, value);
+    });
+
+    auto by_key = [](auto const& x, auto const& y) { return x.key() < y.key(); };
+    std::sort(result.added.begin(), result.added.end(), by_key);
+    std::sort(result.removed.begin(), result.removed.end(), by_key);
+    std::sort(result.changed.begin(), result.changed.end(), [](auto const& x, auto const& y) { return x.key < y.key; });
+
+    return result;
 }
 
 } // namespace red::session
\ No newline at end of file
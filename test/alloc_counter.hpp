@@ -0,0 +1,41 @@
+#ifndef RED_SESSIONS_TEST_ALLOC_COUNTER_HPP
+#define RED_SESSIONS_TEST_ALLOC_COUNTER_HPP
+
+/* Counts heap allocations, for checking allocation free code paths in the tests and benchmarks.
+   It replaces the global operator new and delete, so only one translation unit of a program may include it.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<std::size_t> alloc_count{0};
+
+// kept out of line, inlined into callers GCC sees malloc() paired with operator delete and warns (-Wmismatched-new-delete)
+#if defined(_MSC_VER)
+#define ALLOC_NOINLINE __declspec(noinline)
+#else
+#define ALLOC_NOINLINE __attribute__((noinline))
+#endif
+
+ALLOC_NOINLINE void* operator new(std::size_t n)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+ALLOC_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+ALLOC_NOINLINE void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// allocations made by fn()
+template <class Fn>
+std::size_t count_allocations(Fn&& fn)
+{
+    auto const before = alloc_count.load();
+    fn();
+    return alloc_count.load() - before;
+}
+
+#endif /* RED_SESSIONS_TEST_ALLOC_COUNTER_HPP */
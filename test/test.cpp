@@ -6,6 +6,14 @@
 #include <vector>
 #include <utility>
 #include <typeinfo>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <memory_resource>
+#include <filesystem>
+#include <fstream>
+#include <cstdio>
 
 #include <range/v3/view.hpp>
 #include <range/v3/action.hpp>
@@ -13,6 +21,8 @@
 #include <range/v3/algorithm.hpp>
 
 #include "red/sessions/session.hpp"
+#include "red/sessions/options.hpp"
+#include "alloc_counter.hpp"
 
 using namespace std::literals;
 
@@ -21,6 +31,15 @@ namespace sys
     std::string getenv(std::string_view key);
     void setenv(std::string_view key, std::string_view value);
     void rmenv(std::string_view key);
+
+#if defined(__linux__)
+    struct cmdline_args
+    {
+        std::unique_ptr<char const*[]> storage;
+        int argc = 0;
+    };
+    cmdline_args read_cmdline() noexcept;
+#endif
 }
 
 using std::string;
@@ -101,6 +120,311 @@ TEST_CASE("get environment variables", "[env]")
     }
 }
 
+TEST_CASE("allocation free lookups", "[env]")
+{
+    test_vars_guard _;
+    auto const key = TEST_VARS[3].first;
+    auto const value = TEST_VARS[3].second;
+
+    REQUIRE(environment.contains(key));
+    REQUIRE(environment.try_get(key) == value);
+    REQUIRE(environment.get_or(key, "default") == value);
+
+    REQUIRE_FALSE(environment.contains("nonesuch"));
+    REQUIRE_FALSE(environment.try_get("nonesuch").has_value());
+    REQUIRE(environment.get_or("nonesuch", "default") == "default");
+
+#if !defined(WIN32)
+    SECTION("unset and empty are different")
+    {
+        sys::setenv("RED_EMPTY", "");
+        REQUIRE(environment.contains("RED_EMPTY"));
+        REQUIRE(environment.try_get("RED_EMPTY") == ""sv);
+        REQUIRE(environment.get_or("RED_EMPTY", "default").empty());
+        sys::rmenv("RED_EMPTY");
+    }
+    SECTION("no allocations")
+    {
+        auto const long_key = string(300, 'K');
+        sys::setenv(long_key, "long");
+
+        std::size_t found = 0;
+        auto const allocs = count_allocations([&] {
+            found += environment.contains(key);
+            found += environment.contains("nonesuch");
+            found += environment.contains(long_key);
+            found += environment.try_get(key).has_value();
+            found += environment.try_get(long_key).has_value();
+            found += environment.get_or("nonesuch", "default").size();
+        });
+
+        REQUIRE(found == 11);
+        REQUIRE(allocs == 0);
+        sys::rmenv(long_key);
+    }
+#endif
+#if defined(__linux__)
+    SECTION("cleared environment")
+    {
+        // clearenv() leaves environ null, the variables are set again when the section ends
+        struct restore
+        {
+            std::vector<std::pair<string, string>> vars;
+            ~restore() {
+                for (auto const& [k, v] : vars)
+                    sys::setenv(k, v);
+            }
+        } saved;
+
+        for (string_view line : red::session::environment_view{}) {
+            auto const eq = line.find('=', 1);
+            saved.vars.emplace_back(line.substr(0, eq), eq == string_view::npos ? "" : line.substr(eq + 1));
+        }
+
+        REQUIRE(::clearenv() == 0);
+
+        REQUIRE_FALSE(environment.contains(key));
+        REQUIRE_FALSE(environment.try_get(key).has_value());
+        REQUIRE(environment.get_or(key, "default") == "default");
+        REQUIRE(environment.find(key) == environment.end());
+        REQUIRE_FALSE(environment.contains(RED_ENV_KEY("PATH")));
+        REQUIRE(environment[key].value().empty());
+        REQUIRE(environment.empty());
+        REQUIRE(ranges::distance(red::session::environment_view{}) == 0);
+    }
+#endif
+}
+
+TEST_CASE("hot key cache", "[env]")
+{
+    test_vars_guard _;
+    auto const key = TEST_VARS[3].first;
+    auto const value = TEST_VARS[3].second;
+
+    REQUIRE(environment[key].value() == value);
+
+#if SESSIONS_HOT_KEYS > 0
+    auto hits = [] { return environment.hot_key_stats().hits; };
+    auto misses = [] { return environment.hot_key_stats().misses; };
+
+    SECTION("repeated lookups hit")
+    {
+        auto const before = environment.hot_key_stats();
+        for (int i = 0; i < 10; i++)
+            REQUIRE(environment[key].value() == value);
+
+        REQUIRE(hits() == before.hits + 10);
+        REQUIRE(misses() == before.misses);
+
+        REQUIRE(environment["nonesuch"].value().empty());
+        REQUIRE(environment["nonesuch"].value().empty());
+        REQUIRE(misses() == before.misses + 1);
+    }
+    SECTION("library changes miss")
+    {
+        environment[key] = "changed";
+        auto const before = misses();
+        REQUIRE(environment[key].value() == "changed");
+        REQUIRE(misses() == before + 1);
+
+        environment.erase(key);
+        REQUIRE(environment[key].value().empty());
+    }
+#endif
+    SECTION("external changes are seen")
+    {
+        sys::setenv(key, "external");
+        REQUIRE(environment[key].value() == "external");
+
+        sys::rmenv(key);
+        REQUIRE(environment[key].value().empty());
+
+        REQUIRE(environment["RED_HOT_NEW"].value().empty());
+        sys::setenv("RED_HOT_NEW", "new");
+        REQUIRE(environment["RED_HOT_NEW"].value() == "new");
+
+        // removing an earlier entry moves the later ones
+        sys::rmenv(TEST_VARS[0].first);
+        REQUIRE(environment["RED_HOT_NEW"].value() == "new");
+        REQUIRE(environment[TEST_VARS[4].first].value() == TEST_VARS[4].second);
+        sys::rmenv("RED_HOT_NEW");
+        REQUIRE(environment["RED_HOT_NEW"].value().empty());
+
+        // an unset variable set in place of a removed one, the block keeps its address and size
+        REQUIRE(environment["RED_HOT_X"].value().empty());
+        sys::rmenv(TEST_VARS[1].first);
+        sys::setenv("RED_HOT_X", "set!");
+        REQUIRE(environment["RED_HOT_X"].value() == "set!");
+        REQUIRE(environment.contains("RED_HOT_X"));
+        sys::rmenv("RED_HOT_X");
+        REQUIRE(environment["RED_HOT_X"].value().empty());
+    }
+    SECTION("stats are per thread")
+    {
+        red::session::environment::cache_stats other;
+        std::thread([&] {
+            (void)environment[key].value();
+            other = environment.hot_key_stats();
+        }).join();
+
+        REQUIRE(other.hits == 0);
+        REQUIRE(other.misses == (SESSIONS_HOT_KEYS > 0 ? 1u : 0u));
+    }
+}
+
+TEST_CASE("compile time keys", "[env]")
+{
+    using red::session::env_key;
+    test_vars_guard _;
+
+    constexpr env_key server{ "SERVER" };
+    static_assert(server.size() == 6);
+    static_assert(server.str() == "SERVER");
+    static_assert(server.hash() == red::session::detail::hash_key("SERVER"));
+    REQUIRE(RED_ENV_KEY("PROTOCOL").size() == 8);
+    REQUIRE(server.c_str()[6] == '\0');
+
+    REQUIRE_THROWS_AS(env_key{ "A=B" }, std::invalid_argument);
+
+    SECTION("environment")
+    {
+        REQUIRE(environment[server].value() == "127.0.0.1");
+        REQUIRE(environment[RED_ENV_KEY("PROTOCOL")].value() == "DEFAULT");
+        REQUIRE(environment[RED_ENV_KEY("nonesuch")].value().empty());
+
+        REQUIRE(environment.contains(server));
+        REQUIRE_FALSE(environment.contains(RED_ENV_KEY("nonesuch")));
+        REQUIRE(environment.find(RED_ENV_KEY("nonesuch")) == environment.end());
+
+        auto it = environment.find(server);
+        REQUIRE(it != environment.end());
+        REQUIRE(*it == "SERVER=127.0.0.1");
+
+        // the other key types still pick their overloads
+        REQUIRE(environment[string("SERVER")].value() == "127.0.0.1");
+        REQUIRE(environment["SERVER"sv].value() == "127.0.0.1");
+        REQUIRE(environment.find(string("SERVER")) == it);
+        REQUIRE(environment.try_get(server) == "127.0.0.1"sv);
+    }
+
+    SECTION("changes are seen")
+    {
+        REQUIRE(environment.contains(server));
+        sys::rmenv("SERVER");
+        REQUIRE_FALSE(environment.contains(server));
+        REQUIRE(environment.find(server) == environment.end());
+
+        environment[server] = "10.0.0.1";
+        REQUIRE(environment[server].value() == "10.0.0.1");
+        REQUIRE(*environment.find(server) == "SERVER=10.0.0.1");
+    }
+
+    SECTION("snapshot")
+    {
+        red::session::environment::snapshot const snap;
+        REQUIRE(snap[server] == "127.0.0.1");
+        REQUIRE(snap.contains(RED_ENV_KEY("DRUAGA1")));
+        REQUIRE(snap.find(server) == snap.find("SERVER"));
+        REQUIRE_FALSE(snap.contains(RED_ENV_KEY("nonesuch")));
+        REQUIRE(snap[RED_ENV_KEY("nonesuch")].empty());
+    }
+
+#if !defined(WIN32)
+    SECTION("no allocations")
+    {
+        red::session::environment::snapshot const snap;
+        (void)environment[server].value();
+
+        std::size_t found = 0;
+        auto const allocs = count_allocations([&] {
+            found += environment[server].value().size();
+            found += environment.contains(server);
+            found += environment.find(server) != environment.end();
+            found += snap[server].size();
+            found += snap.contains(server);
+        });
+
+        REQUIRE(found == 21);
+        REQUIRE(allocs == 0);
+    }
+
+    SECTION("long keys aren't copied")
+    {
+        // longer than std::string's and variable's inline buffers
+        auto const& key = RED_ENV_KEY("RED_A_KEY_NAME_THAT_IS_LONGER_THAN_THE_INLINE_BUFFERS_OF_STRINGS_AND_VARIABLES");
+        sys::setenv(key, "value");
+
+        std::size_t found = 0;
+        auto const allocs = count_allocations([&] {
+            found += environment[key].value() == "value"; // a miss, then hits
+            found += environment[key].value() == "value";
+            found += environment.contains(key);
+            found += environment.find(key) != environment.end();
+            found += environment[key].key().data() == key.c_str();
+        });
+
+        REQUIRE(found == 5);
+        REQUIRE(allocs == 0);
+
+        // a variable still sets the variable through the borrowed key
+        auto var = environment[key];
+        var = "changed";
+        REQUIRE(var.key() == key.str());
+        REQUIRE(sys::getenv(key) == "changed");
+        sys::rmenv(key);
+    }
+#endif
+
+    SECTION("keys that aren't static are copied")
+    {
+        auto lookup = [] {
+            char name[] = "SERVER";
+            env_key const key{ name };
+            REQUIRE_FALSE(key.is_static());
+            auto var = environment[key];
+            REQUIRE(environment.contains(key));
+            return var;
+        };
+        auto const var = lookup();
+        [] { char volatile scratch[64]; for (auto& c : scratch) c = 'x'; }();
+
+        REQUIRE(var.key() == "SERVER");
+        REQUIRE(var.value() == "127.0.0.1");
+        REQUIRE(environment[RED_ENV_KEY("SERVER")].value() == "127.0.0.1");
+        REQUIRE(RED_ENV_KEY("SERVER").is_static());
+    }
+}
+
+TEST_CASE("find keys of any length", "[env]")
+{
+    std::vector<string> keys;
+    for (auto length : {1, 2, 15, 16, 17, 31, 32, 33, 64, 200})
+        keys.push_back("K" + string(length - 1, 'x'));
+
+    for (auto const& k : keys)
+        sys::setenv(k, "value of " + k);
+
+    for (auto const& k : keys)
+    {
+        CAPTURE(k);
+        auto it = environment.find(k);
+        REQUIRE(it != environment.end());
+        REQUIRE(*it == k + "=value of " + k);
+
+        // prefixes and extensions of a key don't match it
+        auto const prefix = k.substr(0, k.size() - 1) + "y";
+        auto const longer = k + "x";
+        if (ranges::find(keys, longer) == keys.end())
+            REQUIRE(environment.find(longer) == environment.end());
+        REQUIRE(environment.find(prefix) == environment.end());
+    }
+
+    for (auto const& k : keys)
+        sys::rmenv(k);
+
+    REQUIRE(environment.find(keys.back()) == environment.end());
+}
+
 TEST_CASE("set environment variables", "[env]")
 {
     for(auto[key, value] : TEST_VARS)
@@ -124,6 +448,297 @@ TEST_CASE("remove environment variables", "[env]")
     REQUIRE(environment.find("PROTOCOL") == environment.end());
 }
 
+TEST_CASE("batch changes", "[env]")
+{
+    test_vars_guard _;
+    red::session::environment::batch batch;
+
+    batch.set("RED_BATCH1", "one")
+         .set("RED_BATCH2", "two")
+         .set("RED_BATCH1", "uno")
+         .erase("PROTOCOL")
+         .set("RED_BATCH3", "")
+         .erase("RED_BATCH3");
+
+    REQUIRE(batch.size() == 6);
+    REQUIRE_FALSE(environment.contains("RED_BATCH1"));
+
+    batch.commit();
+    REQUIRE(batch.empty());
+
+    CHECK(environment["RED_BATCH1"].value() == "uno");
+    CHECK(environment["RED_BATCH2"].value() == "two");
+    CHECK(environment.find("RED_BATCH3") == environment.end());
+    CHECK(environment.find("PROTOCOL") == environment.end());
+
+    SECTION("invalid keys change nothing")
+    {
+        for (auto bad : {""sv, "A=B"sv, "NUL\0KEY"sv})
+        {
+            batch.set("RED_BATCH1", "changed").set(bad, "value");
+            REQUIRE_THROWS_AS(batch.commit(), std::invalid_argument);
+            REQUIRE(environment["RED_BATCH1"].value() == "uno");
+            batch.clear();
+        }
+    }
+
+    SECTION("the last change to a key wins")
+    {
+        batch.set("RED_Case", "first").set("RED_CASE", "second").set("RED_case", "third").set("RED_CASE", "fourth");
+        batch.commit();
+#if defined(WIN32)
+        // keys are case insensitive, all four change the same variable
+        REQUIRE(environment["RED_CASE"].value() == "fourth");
+        REQUIRE(environment["RED_Case"].value() == "fourth");
+        REQUIRE(ranges::count_if(red::session::environment_view{}, [](auto line) {
+            return line.size() > 9 && (line[4] == L'C' || line[4] == L'c') && line.find(L'=') == 8;
+        }) == 1);
+#else
+        REQUIRE(environment["RED_Case"].value() == "first");
+        REQUIRE(environment["RED_case"].value() == "third");
+        REQUIRE(environment["RED_CASE"].value() == "fourth");
+#endif
+        batch.erase("RED_Case").erase("RED_case").erase("RED_CASE").commit();
+    }
+
+#if !defined(WIN32)
+    SECTION("new variables are added in the order they were set")
+    {
+        batch.set("RED_ORDER_B", "b").set("RED_ORDER_A", "a").set("RED_ORDER_C", "c").commit();
+
+        auto const b = environment.find("RED_ORDER_B"), a = environment.find("RED_ORDER_A"), c = environment.find("RED_ORDER_C");
+        REQUIRE(b < a);
+        REQUIRE(a < c);
+        batch.erase("RED_ORDER_A").erase("RED_ORDER_B").erase("RED_ORDER_C").commit();
+    }
+#endif
+
+    batch.erase("RED_BATCH1").erase("RED_BATCH2").commit();
+    REQUIRE_FALSE(environment.contains("RED_BATCH1"));
+}
+
+TEST_CASE("env_block", "[env]")
+{
+    using red::session::detail::narrow_copy;
+    test_vars_guard _;
+
+    red::session::environment::batch changes;
+    changes.set("RED_BLOCK", "new").set("SERVER", "localhost").erase("PROTOCOL");
+
+    auto const snap = red::session::environment::snapshot{};
+    auto const block = red::session::env_block(snap, changes);
+
+    REQUIRE(block.size() == snap.size());
+    REQUIRE(block.envp()[block.size()] == nullptr);
+
+    std::vector<string> lines;
+    for (auto p = block.envp(); *p; ++p)
+        lines.push_back(narrow_copy(*p));
+
+    auto has = [&](string_view line) { return ranges::find(lines, line) != lines.end(); };
+    CHECK(has("RED_BLOCK=new"));
+    CHECK(has("SERVER=localhost"));
+    CHECK(has("DRUAGA1=WEED"));
+    CHECK_FALSE(has("PROTOCOL=DEFAULT"));
+
+    // the current environment is left alone
+    REQUIRE_FALSE(environment.contains("RED_BLOCK"));
+    REQUIRE(environment["SERVER"].value() == "127.0.0.1");
+    REQUIRE(environment.contains("PROTOCOL"));
+
+    // new variables follow the base's, in the order they were set
+    red::session::environment::batch added;
+    added.set("RED_ADDED_B", "b").set("RED_ADDED_A", "a");
+    auto const with_added = red::session::env_block(snap, added);
+    REQUIRE(with_added.size() == snap.size() + 2);
+    REQUIRE(narrow_copy(with_added.envp()[snap.size()]) == "RED_ADDED_B=b");
+    REQUIRE(narrow_copy(with_added.envp()[snap.size() + 1]) == "RED_ADDED_A=a");
+
+    changes.set("", "invalid");
+    REQUIRE_THROWS_AS(red::session::env_block(changes), std::invalid_argument);
+}
+
+TEST_CASE("load .env files", "[env][envfile]")
+{
+    using red::session::environment;
+    using red::session::parse_env;
+
+    auto const text =
+        "# settings\n"
+        "RED_PLAIN=value\n"
+        "  export RED_EXPORTED = spaced out   \n"
+        "\n"
+        "RED_COMMENTED=abc # not part of it\n"
+        "RED_HASH=abc#def\n"
+        "RED_EMPTY=\n"
+        "RED_SINGLE='$HOME \\n # kept'\n"
+        "RED_DOUBLE=\"tab\\there \\\"quoted\\\" \\$HOME\" # comment\n"
+        "RED_MULTI=\"first\n"
+        "second\"\r\n"
+        "RED_PLAIN=last wins"s;
+
+    auto const snap = environment::snapshot(parse_env(text));
+    CHECK(snap.size() == 8);
+    CHECK(snap["RED_PLAIN"] == "last wins");
+    CHECK(snap["RED_EXPORTED"] == "spaced out");
+    CHECK(snap["RED_COMMENTED"] == "abc");
+    CHECK(snap["RED_HASH"] == "abc#def");
+    CHECK(snap.contains("RED_EMPTY"));
+    CHECK(snap["RED_EMPTY"].empty());
+    CHECK(snap["RED_SINGLE"] == "$HOME \\n # kept");
+    CHECK(snap["RED_DOUBLE"] == "tab\there \"quoted\" $HOME");
+    CHECK(snap["RED_MULTI"] == "first\nsecond");
+
+    // snapshots of a batch are sorted by key
+    REQUIRE(std::is_sorted(snap.begin(), snap.end(), [](string_view a, string_view b) {
+        return a.substr(0, a.find('=')) < b.substr(0, b.find('='));
+    }));
+    REQUIRE_FALSE(environment{}.contains("RED_PLAIN"));
+
+    SECTION("malformed lines")
+    {
+        auto line_of = [](string_view text) -> std::size_t {
+            try {
+                parse_env(text);
+            }
+            catch (red::session::env_file_error const& e) {
+                return e.line();
+            }
+            return 0;
+        };
+
+        CHECK(line_of("A=1\nB 2\n") == 2);
+        CHECK(line_of("A=1\n=2\n") == 2);
+        CHECK(line_of("A=1\n\nB='open\n\n") == 3);
+        CHECK(line_of("A=\"x\"y\n") == 1);
+        CHECK(line_of("A=\"x\ny\"z\n") == 2);
+        CHECK(line_of("A=1\nexport\n") == 2);
+        CHECK(line_of("A=1\r\nB=2\n") == 0);
+        CHECK(line_of("") == 0);
+    }
+
+    SECTION("from a file")
+    {
+        namespace fs = std::filesystem;
+        auto const file = fs::temp_directory_path() / "red-sessions-test.env";
+        std::ofstream(file, std::ios::binary) << text;
+
+        auto changes = red::session::load_env_file(file.string());
+        REQUIRE(changes.size() == 9);
+        changes.commit();
+
+        CHECK(environment{}["RED_PLAIN"].value() == "last wins");
+        CHECK(environment{}["RED_MULTI"].value() == "first\nsecond");
+
+        for (auto key : { "RED_PLAIN", "RED_EXPORTED", "RED_COMMENTED", "RED_HASH", "RED_EMPTY", "RED_SINGLE", "RED_DOUBLE", "RED_MULTI" })
+            environment{}.erase(key);
+
+        std::ofstream(file, std::ios::trunc);
+        CHECK(red::session::load_env_file(file.string()).empty());
+
+        fs::remove(file);
+        REQUIRE_THROWS_AS(red::session::load_env_file(file.string()), std::system_error);
+    }
+}
+
+TEST_CASE("write the environment to a file descriptor", "[env]")
+{
+    using format = red::session::environment::format;
+    test_vars_guard _;
+
+    auto written = [](format fmt) {
+        auto const file = std::tmpfile();
+#if defined(WIN32)
+        environment.write_to(_fileno(file), fmt);
+#else
+        environment.write_to(fileno(file), fmt);
+#endif
+        string text;
+        std::rewind(file);
+        for (int c; (c = std::fgetc(file)) != EOF; )
+            text += static_cast<char>(c);
+        std::fclose(file);
+        return text;
+    };
+
+    sys::setenv("RED_QUOTES", "it's \"quoted\"\\");
+    sys::setenv("RED_CONTROL", "a\nb\tc\x01");
+    sys::setenv("RED-DASH", "not a shell name");
+
+    SECTION("nul")
+    {
+        auto const text = written(format::nul);
+        REQUIRE(text.back() == '\0');
+        REQUIRE(static_cast<std::size_t>(std::count(text.begin(), text.end(), '\0')) == environment.size());
+        REQUIRE(text.find("\0SERVER=127.0.0.1\0"sv) != string::npos);
+        REQUIRE(text.find("\0RED-DASH=not a shell name\0"sv) != string::npos);
+    }
+
+    SECTION("shell")
+    {
+        auto const text = written(format::shell);
+        REQUIRE(text.back() == '\n');
+        REQUIRE(text.find("export SERVER='127.0.0.1'\n") != string::npos);
+        REQUIRE(text.find("export RED_QUOTES='it'\\''s \"quoted\"\\'\n") != string::npos);
+        REQUIRE(text.find("export RED_CONTROL='a\nb\tc\x01'\n") != string::npos);
+        REQUIRE(text.find("RED-DASH") == string::npos);
+    }
+
+    SECTION("json")
+    {
+        auto const text = written(format::json);
+        REQUIRE(text.substr(0, 2) == "{\"");
+        REQUIRE(text.substr(text.size() - 2) == "}\n");
+        REQUIRE(text.find("\"SERVER\":\"127.0.0.1\"") != string::npos);
+        REQUIRE(text.find("\"RED_QUOTES\":\"it's \\\"quoted\\\"\\\\\"") != string::npos);
+        REQUIRE(text.find("\"RED_CONTROL\":\"a\\nb\\tc\\u0001\"") != string::npos);
+        REQUIRE(text.find("\"RED-DASH\":\"not a shell name\"") != string::npos);
+        REQUIRE(text.find('\n') == text.size() - 1);
+
+        // values are scanned 8 bytes at a time, escapes are found at any position
+        for (std::size_t i = 0; i < 20; i++)
+        {
+            auto value = string(20, '\xC3');
+            value[i] = i % 2 ? '\\' : '\x1f';
+            sys::setenv("RED_AT", value);
+
+            auto const escaped = value.substr(0, i) + (i % 2 ? "\\\\" : "\\u001f") + value.substr(i + 1);
+            CAPTURE(i);
+            REQUIRE(written(format::json).find("\"RED_AT\":\"" + escaped + "\"") != string::npos);
+        }
+        sys::rmenv("RED_AT");
+    }
+
+    SECTION("more than a buffer")
+    {
+        // long values are written in place, short ones through the buffer
+        auto const long_value = string(100000, 'x');
+        for (int i = 0; i < 2000; i++)
+            sys::setenv("RED_MANY_" + std::to_string(i), i % 100 == 0 ? long_value : "value " + std::to_string(i));
+
+        auto const text = written(format::nul);
+        REQUIRE(static_cast<std::size_t>(std::count(text.begin(), text.end(), '\0')) == environment.size());
+        REQUIRE(text.find("\0RED_MANY_1999=value 1999\0"sv) != string::npos);
+        REQUIRE(text.find("\0RED_MANY_1000=" + long_value + '\0') != string::npos);
+
+        auto const shell = written(format::shell);
+        REQUIRE(shell.find("export RED_MANY_1999='value 1999'\n") != string::npos);
+        REQUIRE(shell.find("export RED_MANY_1000='" + long_value + "'\n") != string::npos);
+
+        for (int i = 0; i < 2000; i++)
+            sys::rmenv("RED_MANY_" + std::to_string(i));
+    }
+
+    SECTION("write errors")
+    {
+        REQUIRE_THROWS_AS(environment.write_to(-1), std::system_error);
+    }
+
+    sys::rmenv("RED_QUOTES");
+    sys::rmenv("RED_CONTROL");
+    sys::rmenv("RED-DASH");
+}
+
 TEST_CASE("environment iteration", "[env]")
 {
     using namespace ranges;
@@ -142,6 +757,37 @@ TEST_CASE("environment iteration", "[env]")
             REQUIRE(v.find('=') == std::string::npos);
         }
     }
+    SECTION("Key/Value pairs")
+    {
+        test_vars_guard _g_;
+
+        for (auto [k, v] : environment.pairs())
+        {
+            CAPTURE(k);
+            REQUIRE(k.find('=') == std::string::npos);
+            REQUIRE(environment[k].value() == v);
+        }
+
+        auto it = ranges::find_if(environment.pairs(), [](auto kv) { return kv.first == TEST_VARS[3].first; });
+        REQUIRE((*it).second == TEST_VARS[3].second);
+    }
+#if !defined(WIN32)
+    SECTION("allocation free")
+    {
+        std::size_t total = 0;
+        auto const allocs = count_allocations([&] {
+            for (auto k : environment.keys())
+                total += k.size();
+            for (auto v : environment.values())
+                total += v.size();
+            for (auto [k, v] : environment.pairs())
+                total += k.size() + v.size();
+        });
+
+        REQUIRE(total > 0);
+        REQUIRE(allocs == 0);
+    }
+#endif
     SECTION("iterator")
     {
         auto begin = environment.begin();
@@ -160,6 +806,30 @@ TEST_CASE("environment iteration", "[env]")
 
 }
 
+TEST_CASE("environment view", "[env][range]")
+{
+    test_vars_guard _g_;
+    auto const view = environment.view();
+
+    REQUIRE(view.size() == environment.size());
+    REQUIRE(ranges::equal(view, environment, [](auto a, auto b) {
+        return red::session::detail::narrow_copy(a.data()) == b;
+    }));
+
+#if !defined(WIN32)
+    std::size_t total = 0;
+    auto const allocs = count_allocations([&] {
+        for (string_view line : view)
+            total += line.size();
+        total += view.size();
+        total += environment.find(TEST_VARS[2].first) != environment.end();
+    });
+
+    REQUIRE(total > 0);
+    REQUIRE(allocs == 0);
+#endif
+}
+
 TEST_CASE("environment::variable", "[var]")
 {
     using ranges::to;
@@ -190,11 +860,218 @@ TEST_CASE("environment::variable", "[var]")
     }
 }
 
+TEST_CASE("split_index", "[var]")
+{
+    using red::session::split_index;
+
+    SECTION("entries")
+    {
+        auto const index = split_index("a:bb::ccc:", ':');
+        REQUIRE(index.size() == 5);
+        REQUIRE(ranges::equal(index, std::array{ "a"sv, "bb"sv, ""sv, "ccc"sv, ""sv }));
+        REQUIRE(index[3] == "ccc");
+        REQUIRE(index.end() - index.begin() == 5);
+        REQUIRE(*(index.end() - 2) == "ccc");
+        REQUIRE_THROWS_AS(index.at(5), std::out_of_range);
+    }
+
+    SECTION("n separators make n+1 entries")
+    {
+        REQUIRE(split_index("", ':').empty());
+        REQUIRE(split_index("abc", ':').size() == 1);
+        REQUIRE(split_index(":", ':').size() == 2);
+        REQUIRE(split_index("::", ':').size() == 3);
+    }
+
+    SECTION("same entries as split()")
+    {
+        auto var = environment["mysplitvar"] = "values.separated.by.dots";
+        auto const index = var.index('.');
+        REQUIRE(index.size() == 4);
+
+        size_t i = 0;
+        for (auto p : var.split('.'))
+            REQUIRE(index[i++] == ranges::to<string>(p));
+
+        REQUIRE(red::session::environment::snapshot().ref("mysplitvar").index('.')[2] == "by");
+        environment.erase("mysplitvar");
+    }
+}
+
+enum class level { low, medium, high };
+enum class raw_level : unsigned char { a, b, c };
+
+template <>
+struct red::session::enum_names<level>
+{
+    static constexpr std::pair<std::string_view, level> values[] = {
+        { "low", level::low }, { "medium", level::medium }, { "high", level::high },
+    };
+};
+
+TEST_CASE("typed values", "[var]")
+{
+    using namespace std::chrono_literals;
+    using red::session::value_traits;
+
+    SECTION("value_traits")
+    {
+        CHECK(value_traits<int>::parse("-42") == -42);
+        CHECK(value_traits<unsigned>::parse("42") == 42u);
+        CHECK(value_traits<double>::parse("2.5") == 2.5);
+        CHECK_FALSE(value_traits<int>::parse(""));
+        CHECK_FALSE(value_traits<int>::parse("4x"));
+        CHECK_FALSE(value_traits<int>::parse(" 4"));
+        CHECK_FALSE(value_traits<unsigned char>::parse("300"));
+
+        CHECK(value_traits<bool>::parse("TRUE") == true);
+        CHECK(value_traits<bool>::parse("on") == true);
+        CHECK(value_traits<bool>::parse("0") == false);
+        CHECK(value_traits<bool>::parse("No") == false);
+        CHECK_FALSE(value_traits<bool>::parse("maybe"));
+
+        CHECK(value_traits<std::chrono::milliseconds>::parse("250") == 250ms);
+        CHECK(value_traits<std::chrono::milliseconds>::parse("2s") == 2000ms);
+        CHECK(value_traits<std::chrono::milliseconds>::parse("2000us") == 2ms);
+        CHECK_FALSE(value_traits<std::chrono::milliseconds>::parse("1500us"));
+        CHECK(value_traits<std::chrono::seconds>::parse("2m") == 120s);
+        CHECK(value_traits<std::chrono::seconds>::parse("1h") == 3600s);
+        CHECK(value_traits<std::chrono::duration<double>>::parse("1.5s") == std::chrono::duration<double>(1.5));
+        CHECK_FALSE(value_traits<std::chrono::seconds>::parse("1.5s"));
+        CHECK_FALSE(value_traits<std::chrono::seconds>::parse("5 days"));
+        CHECK_FALSE(value_traits<std::chrono::seconds>::parse("s"));
+
+        CHECK(value_traits<level>::parse("High") == level::high);
+        CHECK_FALSE(value_traits<level>::parse("2"));
+        CHECK(value_traits<raw_level>::parse("2") == raw_level::c);
+    }
+
+    SECTION("variable::as")
+    {
+        environment["RED_TYPED"] = "8";
+        auto const var = environment["RED_TYPED"];
+        CHECK(var.as<int>() == 8);
+        CHECK(var.as<double>() == 8.0);
+        CHECK(var.as<bool>() == std::nullopt);
+        CHECK(var.as<bool>(true));
+        CHECK(red::session::environment::snapshot{}.ref("RED_TYPED").as<long>() == 8);
+        environment.erase("RED_TYPED");
+    }
+
+    SECTION("environment::get")
+    {
+        environment["RED_TYPED_THREADS"] = "16";
+        environment["RED_TYPED_TIMEOUT"] = "250ms";
+        environment["RED_TYPED_LEVEL"] = "medium";
+
+        CHECK(environment.get<int>("RED_TYPED_THREADS") == 16);
+        CHECK(environment.get("RED_TYPED_THREADS", 1) == 16);
+        CHECK(environment.get("RED_TYPED_TIMEOUT", 1000ms) == 250ms);
+        CHECK(environment.get("RED_TYPED_TIMEOUT", 1s) == 1s);
+        CHECK(environment.get("RED_TYPED_LEVEL", level::low) == level::medium);
+        CHECK(environment.get<std::string>("RED_TYPED_LEVEL") == "medium");
+        CHECK(environment.get("RED_TYPED_NONESUCH", 7) == 7);
+        CHECK(environment.get("RED_TYPED_LEVEL", 7) == 7);
+
+        // cached results make no allocations
+        auto const allocs = count_allocations([] {
+            for (int i = 0; i < 10; i++)
+                REQUIRE(environment.get("RED_TYPED_THREADS", 1) == 16);
+        });
+        CHECK(allocs == 0);
+
+        // changes made through the library are picked up
+        environment["RED_TYPED_THREADS"] = "32";
+        CHECK(environment.get("RED_TYPED_THREADS", 1) == 32);
+        environment["RED_TYPED_OTHER"] = "x";
+        CHECK(environment.get("RED_TYPED_THREADS", 1) == 32);
+        environment.erase("RED_TYPED_THREADS");
+        CHECK(environment.get<int>("RED_TYPED_THREADS") == std::nullopt);
+
+        for (auto key : { "RED_TYPED_TIMEOUT", "RED_TYPED_LEVEL", "RED_TYPED_OTHER" })
+            environment.erase(key);
+    }
+
+    SECTION("the cache has a fixed size")
+    {
+        // more keys than the cache has entries, they evict each other
+        std::vector<string> keys;
+        for (int i = 0; i < 100; i++) {
+            keys.push_back("RED_TYPED_" + std::to_string(i));
+            environment[keys.back()] = std::to_string(i);
+        }
+
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < 100; i++)
+                REQUIRE(environment.get<int>(keys[i]) == i);
+        }
+
+        for (auto const& key : keys)
+            environment.erase(key);
+        REQUIRE(environment.get<int>(keys[0]) == std::nullopt);
+    }
+}
+
+TEST_CASE("variable storage", "[var]")
+{
+    test_vars_guard _g_;
+
+    SECTION("short variables")
+    {
+#if !defined(WIN32)
+        auto const allocs = count_allocations([] {
+            auto var = environment[TEST_VARS[1].first];
+            (void)var;
+        });
+        REQUIRE(allocs == 0);
+#endif
+        auto var = environment[TEST_VARS[1].first];
+        REQUIRE(var.key() == TEST_VARS[1].first);
+        REQUIRE(var.value() == TEST_VARS[1].second);
+    }
+    SECTION("copies and long values")
+    {
+        auto const long_value = string(300, 'v');
+        auto var = environment["RED_LONG"] = long_value;
+        auto copy = var;
+        auto moved = std::move(var);
+
+        REQUIRE(copy.value() == long_value);
+        REQUIRE(moved.value() == long_value);
+        REQUIRE(string(copy) == long_value);
+        REQUIRE(environment["RED_LONG"].value() == long_value);
+
+        copy = "short";
+        REQUIRE(copy.key() == "RED_LONG");
+        REQUIRE(environment["RED_LONG"].value() == "short");
+        REQUIRE(moved.value() == long_value);
+
+        environment.erase("RED_LONG");
+    }
+    SECTION("variable_ref")
+    {
+        auto const snap = red::session::environment::snapshot{};
+        auto ref = snap.ref(TEST_VARS[2].first);
+        REQUIRE(ref.key() == TEST_VARS[2].first);
+        REQUIRE(ref.value() == TEST_VARS[2].second);
+        REQUIRE(snap.ref("nonesuch").value().empty());
+
+#if !defined(WIN32)
+        red::session::environment::variable_ref envref;
+        auto const allocs = count_allocations([&] {
+            envref = environment.ref(TEST_VARS[2].first);
+        });
+        REQUIRE(allocs == 0);
+        REQUIRE(envref.value() == TEST_VARS[2].second);
+#endif
+    }
+}
+
 TEST_CASE("use environment like a range", "[env][range]")
 {
     test_vars_guard _g_;
 
-    auto dist = ranges::distance(environment);
+    auto const dist = static_cast<std::size_t>(ranges::distance(environment));
     REQUIRE(dist == environment.size());
 
     auto const envline = string(TEST_VARS[0].first) + "="s + string(TEST_VARS[0].second);
@@ -205,6 +1082,328 @@ TEST_CASE("use environment like a range", "[env][range]")
     REQUIRE(ranges::distance(environment.begin(), range_it) == ranges::distance(environment.begin(), env_it));
 }
 
+TEST_CASE("environment snapshot", "[env][snapshot]")
+{
+    test_vars_guard _g_;
+    auto const snap = red::session::environment::snapshot{};
+
+    REQUIRE(snap.size() == environment.size());
+
+    for(auto[key, value] : TEST_VARS)
+    {
+        REQUIRE(snap.contains(key));
+        REQUIRE(snap[key] == value);
+
+        auto it = snap.find(key);
+        REQUIRE(it != snap.end());
+        REQUIRE(*it == string(key) + "=" + string(value));
+    }
+
+    REQUIRE_FALSE(snap.contains("nonesuch"));
+    REQUIRE(snap["nonesuch"].empty());
+    REQUIRE_FALSE(snap.contains("DRUAGA"));
+
+    SECTION("unaffected by later changes")
+    {
+        environment["DRUAGA1"] = "changed";
+        environment.erase("PROTOCOL");
+
+        REQUIRE(snap["DRUAGA1"] == "WEED");
+        REQUIRE(snap.contains("PROTOCOL"));
+
+        auto const copy = snap;
+        REQUIRE(copy.begin() == snap.begin());
+    }
+}
+
+TEST_CASE("snapshot diff", "[env][snapshot]")
+{
+    using red::session::environment;
+    test_vars_guard _;
+
+    auto const before = environment::snapshot{};
+    auto const token = environment::token();
+    REQUIRE_FALSE(environment::has_changed_since(token));
+    REQUIRE_FALSE(environment::has_changed_since(before.token()));
+    REQUIRE(red::session::diff(before, before).empty());
+    REQUIRE(red::session::diff(before, environment::snapshot{}).empty());
+
+    sys::setenv("RED_DIFF_ADDED", "new");
+    sys::setenv("SERVER", "localhost");
+    sys::rmenv("PROTOCOL");
+    sys::rmenv("DRUAGA1");
+
+    // changes made outside the library are caught too
+    REQUIRE(environment::has_changed_since(token));
+    REQUIRE(environment::has_changed_since(before.token()));
+
+    auto const after = environment::snapshot{};
+    auto const d = red::session::diff(before, after);
+
+    REQUIRE(d.added.size() == 1);
+    CHECK(d.added[0].key() == "RED_DIFF_ADDED");
+    CHECK(d.added[0].value() == "new");
+
+    REQUIRE(d.removed.size() == 2);
+    CHECK(d.removed[0].key() == "DRUAGA1");
+    CHECK(d.removed[0].value() == "WEED");
+    CHECK(d.removed[1].key() == "PROTOCOL");
+
+    REQUIRE(d.changed.size() == 1);
+    CHECK(d.changed[0].key == "SERVER");
+    CHECK(d.changed[0].before == "127.0.0.1");
+    CHECK(d.changed[0].after == "localhost");
+
+    auto const back = red::session::diff(after, before);
+    CHECK(back.added.size() == 2);
+    CHECK(back.removed.size() == 1);
+    CHECK(back.changed.size() == 1);
+
+    SECTION("tokens")
+    {
+        auto const now = environment::token();
+        REQUIRE(after.token() == now);
+        ::environment["RED_DIFF_ADDED"] = "changed";
+        REQUIRE(environment::has_changed_since(now));
+
+        red::session::environment::batch changes;
+        changes.set("RED_DIFF_ADDED", "changed");
+        REQUIRE(environment::has_changed_since(environment::snapshot(changes).token()));
+    }
+
+    sys::rmenv("RED_DIFF_ADDED");
+}
+
+TEST_CASE("case insensitive lookups", "[env][snapshot]")
+{
+    using red::session::ci_index;
+    using red::session::environment;
+
+    red::session::environment::batch changes;
+    changes.set("PATH", "upper").set("Path", "mixed").set("Home", "/home").set("\xC3\x81" "B", "non ascii");
+    environment::snapshot const snap{ changes };
+
+    SECTION("exact_first")
+    {
+        ci_index const index{ snap };
+        CHECK(index["HOME"] == "/home");
+        CHECK(index["home"] == "/home");
+        CHECK(index["PATH"] == "upper");
+        CHECK(index["Path"] == "mixed");
+        CHECK(index["path"] == "upper");
+        CHECK(index.ambiguous("pAtH"));
+        CHECK_FALSE(index.ambiguous("home"));
+        CHECK_FALSE(index.contains("nonesuch"));
+        CHECK_FALSE(index.contains("hom"));
+
+        // only ASCII letters are folded
+        CHECK(index.contains("\xC3\x81" "b"));
+        CHECK_FALSE(index.contains("\xC3\xA1" "b"));
+    }
+
+    SECTION("first")
+    {
+        ci_index const index{ snap, ci_index::policy::first };
+        CHECK(index["Path"] == "upper");
+        CHECK(index["home"] == "/home");
+    }
+
+    SECTION("reject")
+    {
+        ci_index const index{ snap, ci_index::policy::reject };
+        CHECK_FALSE(index.contains("PATH"));
+        CHECK_FALSE(index.contains("path"));
+        CHECK(index.find("path") == index.end());
+        CHECK(index["home"] == "/home");
+    }
+
+    SECTION("from the environment")
+    {
+        test_vars_guard _;
+        ci_index const index{ environment::snapshot{} };
+        CHECK(index["druaga1"] == "WEED");
+        CHECK(index["PHASELLUS"] == "LoremIpsumDolor");
+        CHECK(index.snapshot().size() == ::environment.size());
+    }
+}
+
+TEST_CASE("sorted key index", "[env][snapshot]")
+{
+    using red::session::key_index;
+    using red::session::environment;
+
+    auto keys_of = [](auto const& rng) {
+        std::vector<string> keys;
+        for (auto var : rng)
+            keys.emplace_back(var.key());
+        return keys;
+    };
+
+    red::session::environment::batch changes;
+    changes.set("OTEL_B", "b").set("APP_NAME", "app").set("OTEL_A", "a").set("OTEL", "bare")
+           .set("APP_", "empty suffix").set("OTELX", "x").set("ZED", "z").set("APO", "apo");
+    key_index const index{ environment::snapshot{ changes } };
+
+    SECTION("sorted iteration")
+    {
+        REQUIRE(index.size() == 8);
+        REQUIRE(keys_of(index) == std::vector<string>{ "APO", "APP_", "APP_NAME", "OTEL", "OTELX", "OTEL_A", "OTEL_B", "ZED" });
+        REQUIRE(std::is_sorted(index.begin(), index.end(), [](auto a, auto b) { return a.key() < b.key(); }));
+    }
+
+    SECTION("with_prefix")
+    {
+        auto const otel = index.with_prefix("OTEL_");
+        REQUIRE(otel.size() == 2);
+        REQUIRE(otel[0].key() == "OTEL_A");
+        REQUIRE(otel[0].value() == "a");
+        REQUIRE(otel[1].value() == "b");
+
+        REQUIRE(keys_of(index.with_prefix("OTEL")) == std::vector<string>{ "OTEL", "OTELX", "OTEL_A", "OTEL_B" });
+        REQUIRE(keys_of(index.with_prefix("APP_")) == std::vector<string>{ "APP_", "APP_NAME" });
+        REQUIRE(index.with_prefix("").size() == index.size());
+        REQUIRE(index.with_prefix("A").size() == 3);
+        REQUIRE(index.with_prefix("APP_NAMES").empty());
+        REQUIRE(index.with_prefix("B").empty());
+        REQUIRE(index.with_prefix("ZZ").empty());
+    }
+
+    SECTION("range")
+    {
+        REQUIRE(keys_of(index.range("APP", "OTEL")) == std::vector<string>{ "APP_", "APP_NAME" });
+        REQUIRE(keys_of(index.range("OTEL_", "OTEL_B")) == std::vector<string>{ "OTEL_A" });
+        REQUIRE(index.range("A", "ZZZ").size() == index.size());
+        REQUIRE(index.range("ZED", "APO").empty());
+        REQUIRE(index.range("B", "C").empty());
+    }
+
+    SECTION("ranges outlive the index")
+    {
+        auto otel = key_index{ environment::snapshot{ changes } }.with_prefix("OTEL_");
+        REQUIRE(keys_of(otel) == std::vector<string>{ "OTEL_A", "OTEL_B" });
+    }
+
+    SECTION("from the environment")
+    {
+        test_vars_guard _;
+        sys::setenv("RED_PREFIX_B", "2");
+        sys::setenv("RED_PREFIX_A", "1");
+
+        auto const found = environment::with_prefix("RED_PREFIX_");
+        REQUIRE(keys_of(found) == std::vector<string>{ "RED_PREFIX_A", "RED_PREFIX_B" });
+
+        // the index is rebuilt after changes, results taken before keep their snapshot
+        sys::setenv("RED_PREFIX_C", "3");
+        ::environment.erase("RED_PREFIX_A");
+        REQUIRE(keys_of(environment::with_prefix("RED_PREFIX_")) == std::vector<string>{ "RED_PREFIX_B", "RED_PREFIX_C" });
+        REQUIRE(found.size() == 2);
+        REQUIRE(found[0].value() == "1");
+
+        REQUIRE(environment::sorted_keys().size() == ::environment.size());
+
+        // variables added elsewhere are seen without a change made through the library
+        sys::setenv("RED_PREFIX_D", "4");
+        REQUIRE(environment::with_prefix("RED_PREFIX_").size() == 3);
+
+        // an unchanged environment reuses the index
+        auto const held = environment::sorted_keys();
+        auto data_of = [](red::session::key_index const& index) { return index.snapshot().begin()->data(); };
+        REQUIRE(data_of(environment::sorted_keys()) == data_of(held));
+
+        environment::drop_sorted_keys();
+        REQUIRE(data_of(environment::sorted_keys()) != data_of(held));
+        REQUIRE(environment::sorted_keys().size() == held.size());
+
+        sys::rmenv("RED_PREFIX_B");
+        sys::rmenv("RED_PREFIX_C");
+        sys::rmenv("RED_PREFIX_D");
+    }
+}
+
+TEST_CASE("concurrent store", "[env][snapshot][store]")
+{
+    test_vars_guard _g_;
+
+    environment.erase("RED_STRESS");
+    environment.enable_store();
+    {
+        auto snap = environment.pin();
+        REQUIRE(snap->contains(TEST_VARS[0].first));
+        REQUIRE_FALSE(snap->contains("RED_STRESS"));
+    }
+
+    constexpr int writes = 2000;
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+
+    auto reader = [&] {
+        int last = -1;
+        while (!done)
+        {
+            auto snap = environment.pin();
+            auto const value = (*snap)["RED_STRESS"];
+            int const n = value.empty() ? -1 : std::stoi(string(value));
+
+            // values must never go back in time, and every entry must still be readable
+            std::size_t total = 0;
+            for (auto line : *snap)
+                total += line.size();
+
+            if (n < last || total == 0 || !snap->contains(TEST_VARS[1].first))
+                failures++;
+            last = n;
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back(reader);
+
+    for (int i = 0; i < writes; i++)
+        environment["RED_STRESS"] = std::to_string(i);
+
+    done = true;
+    for (auto& t : readers)
+        t.join();
+
+    REQUIRE(failures == 0);
+    REQUIRE((*environment.pin())["RED_STRESS"] == std::to_string(writes - 1));
+
+    environment.erase("RED_STRESS");
+    REQUIRE_FALSE(environment.pin()->contains("RED_STRESS"));
+}
+
+TEST_CASE("environment size and random access", "[env][range]")
+{
+    test_vars_guard _g_;
+    auto const size = environment.size();
+
+    REQUIRE(size == static_cast<std::size_t>(ranges::distance(environment.view())));
+    REQUIRE(environment.end() - environment.begin() == static_cast<std::ptrdiff_t>(size));
+    REQUIRE(environment.begin()[size - 1] == *ranges::prev(environment.end()));
+
+    auto it = environment.find(TEST_VARS[4].first);
+    auto const pos = it - environment.begin();
+    REQUIRE(*(environment.begin() + pos) == *it);
+
+    SECTION("changes made through the library")
+    {
+        environment["RED_SIZE"] = "1";
+        REQUIRE(environment.size() == size + 1);
+        environment.erase("RED_SIZE");
+        REQUIRE(environment.size() == size);
+    }
+    SECTION("changes made elsewhere")
+    {
+        sys::setenv("RED_SIZE", "1");
+        REQUIRE(environment.size() == size + 1);
+        sys::rmenv("RED_SIZE");
+        REQUIRE(environment.size() == size);
+        sys::rmenv(TEST_VARS[0].first);
+        REQUIRE(environment.size() == size - 1);
+    }
+}
+
 TEST_CASE("join_paths")
 {
     using red::session::join_paths;
@@ -227,6 +1426,387 @@ TEST_CASE("join_paths")
         result = join_paths(elems,';');
         REQUIRE(result == expected);
     }
+
+    SECTION("empty elements and trailing separators")
+    {
+        REQUIRE(join_paths(std::vector<string_view>{}, ';').empty());
+        REQUIRE(join_paths(std::array{ ""sv }, ';').empty());
+        REQUIRE(join_paths(std::array{ "a"sv, ""sv }, ';') == "a");
+        REQUIRE(join_paths(std::array{ "a"sv, ""sv, "b"sv }, ';') == "a;;b");
+        REQUIRE(join_paths(std::array{ "a"sv, "b;"sv }, ';') == "a;b");
+        REQUIRE(join_paths(std::array{ "a"sv, ";"sv }, ';') == "a;");
+    }
+
+    SECTION("string separators")
+    {
+        REQUIRE(join_paths(elems, ", ") == "path, dir, folder, location");
+        REQUIRE(join_paths(elems, ""s) == "pathdirfolderlocation");
+        REQUIRE(join_paths(std::array{ "a"sv, ""sv }, "--") == "a");
+    }
+
+    SECTION("filesystem paths")
+    {
+        auto const paths = std::vector<std::filesystem::path>{ "/usr/bin", "/bin", "relative/dir" };
+        auto const joined = "/usr/bin" + string(1, environment.path_separator) + "/bin" + environment.path_separator + "relative/dir";
+        REQUIRE(join_paths(paths) == joined);
+        REQUIRE(join_paths(paths.begin(), paths.end()) == joined);
+    }
+
+    SECTION("append into buffers")
+    {
+        string buffer = "PATH=";
+        REQUIRE(&red::session::join_paths_into(buffer, elems, ';') == &buffer);
+        REQUIRE(buffer == "PATH="s + string(joinend_elems));
+
+        // views of the elements are joined with a single allocation
+        string other;
+        auto const allocs = count_allocations([&] { red::session::join_paths_into(other, elems, "; "); });
+        REQUIRE(allocs == 1);
+        REQUIRE(other == "path; dir; folder; location");
+
+        char out[64] = {};
+        auto end = red::session::join_paths_into(out, elems, ';');
+        REQUIRE(string_view(out, end - out) == joinend_elems);
+
+        std::vector<char> chars;
+        red::session::join_paths_into(std::back_inserter(chars), std::vector<string>{ "x", "y", "" }, ';');
+        REQUIRE(string_view(chars.data(), chars.size()) == "x;y");
+    }
+
+    SECTION("input ranges of temporaries")
+    {
+        auto const upper = elems | ranges::views::transform([](string_view e) { return string(e) + "/"; });
+        REQUIRE(join_paths(upper, ':') == "path/:dir/:folder/:location/");
+    }
+}
+
+TEST_CASE("memory resources", "[pmr]")
+{
+    namespace pmr = red::session::pmr;
+
+    // everything has to fit in 'buffer', nothing may reach the global heap
+    std::vector<std::byte> buffer(1 << 20);
+    std::pmr::monotonic_buffer_resource arena{ buffer.data(), buffer.size(), std::pmr::null_memory_resource() };
+
+    for (auto [key, value] : TEST_VARS)
+        sys::setenv(key, value);
+
+    SECTION("snapshot")
+    {
+        auto const allocs = count_allocations([&] {
+            red::session::environment::snapshot snap{ &arena };
+            auto copy = snap;
+            for (auto [key, value] : TEST_VARS)
+                REQUIRE(copy[key] == value);
+        });
+        REQUIRE(allocs == 0);
+    }
+
+    SECTION("variable")
+    {
+        std::pmr::vector<pmr::variable> vars{ &arena };
+        auto const allocs = count_allocations([&] {
+            for (auto [key, value] : TEST_VARS)
+                vars.emplace_back(key);
+        });
+        REQUIRE(allocs == 0);
+
+        for (size_t i = 0; i < TEST_VARS.size(); i++) {
+            REQUIRE(vars[i].key() == TEST_VARS[i].first);
+            REQUIRE(vars[i].value() == TEST_VARS[i].second);
+            REQUIRE(vars[i].get_allocator().resource() == &arena);
+        }
+
+        pmr::variable var{ "RED_PMR_VAR", &arena };
+        REQUIRE(var.value().empty());
+        var = "a long enough value to not fit in a small string";
+        REQUIRE(sys::getenv("RED_PMR_VAR") == var.value());
+        REQUIRE(pmr::variable("RED_PMR_VAR").value() == var.value());
+        environment.erase("RED_PMR_VAR");
+    }
+
+    SECTION("join_paths")
+    {
+        auto elems = std::array{ "path"sv, "dir"sv, "a somewhat long folder name"sv, "location"sv };
+
+        std::pmr::string result{ &arena };
+        auto const allocs = count_allocations([&] {
+            result = red::session::join_paths(elems, ';', &arena);
+        });
+        REQUIRE(allocs == 0);
+        REQUIRE(result == "path;dir;a somewhat long folder name;location");
+        REQUIRE(red::session::join_paths(elems.begin(), elems.begin(), ';', &arena).empty());
+    }
+
+    SECTION("narrowing and splitting keep the resource")
+    {
+        auto const line = red::session::detail::pmr_narrow_copy((*environment.view().begin()).data(), &arena);
+        auto const [key, value] = red::session::detail::keyval_pair_fn()(line);
+        REQUIRE(key.get_allocator().resource() == &arena);
+        REQUIRE(value.get_allocator().resource() == &arena);
+        REQUIRE(key + "=" + value == line);
+    }
+
+    for (auto [key, value] : TEST_VARS)
+        sys::rmenv(key);
+}
+
+TEST_CASE("find executables in PATH", "[path]")
+{
+    namespace fs = std::filesystem;
+    using namespace std::chrono_literals;
+
+#if defined(WIN32)
+    auto const suffix = ".exe"s;
+#else
+    auto const suffix = ""s;
+#endif
+
+    auto const root = fs::temp_directory_path() / "red-sessions-path-test";
+    auto const first = root / "first", second = root / "second";
+    fs::remove_all(root);
+    fs::create_directories(first);
+    fs::create_directories(second);
+
+    auto make_file = [&](fs::path const& dir, string const& name, bool exec = true) {
+        auto file = dir / (name + suffix);
+        std::ofstream(file) << "#!/bin/sh\n";
+        if (exec)
+            fs::permissions(file, fs::perms::owner_all, fs::perm_options::add);
+        else
+            fs::permissions(file, fs::perms::owner_exec | fs::perms::group_exec | fs::perms::others_exec, fs::perm_options::remove);
+        return file.string();
+    };
+
+    auto const in_both = make_file(first, "red-tool");
+    make_file(second, "red-tool");
+    auto const in_second = make_file(second, "red-other");
+
+    auto const old_path = sys::getenv("PATH");
+    sys::setenv("PATH", first.string() + environment.path_separator + second.string());
+
+    red::session::executable_cache cache{ 0ms };
+
+    SECTION("earlier directories win")
+    {
+        REQUIRE(cache.find("red-tool") == in_both);
+        REQUIRE(cache.find("red-other") == in_second);
+        REQUIRE_FALSE(cache.find("red-nonesuch"));
+        REQUIRE_FALSE(cache.find(""));
+    }
+
+    SECTION("batched lookups")
+    {
+        auto const found = cache.find({ "red-other", "red-nonesuch", "red-tool" });
+        REQUIRE(found.size() == 3);
+        REQUIRE(found[0] == in_second);
+        REQUIRE_FALSE(found[1]);
+        REQUIRE(found[2] == in_both);
+    }
+
+    SECTION("new files are found")
+    {
+        REQUIRE_FALSE(cache.find("red-new"));
+        auto const created = make_file(first, "red-new");
+        REQUIRE(cache.find("red-new") == created);
+    }
+
+    SECTION("PATH changes are followed")
+    {
+        REQUIRE(cache.find("red-tool") == in_both);
+        sys::setenv("PATH", second.string());
+        REQUIRE(cache.find("red-tool") == (second / ("red-tool" + suffix)).string());
+    }
+
+    SECTION("relative directories follow the current directory")
+    {
+        auto const cwd = fs::current_path();
+        auto const elsewhere = root / "elsewhere";
+        fs::create_directories(elsewhere / "second");
+        auto const other_tool = make_file(elsewhere / "second", "red-tool");
+
+        sys::setenv("PATH", "second");
+        fs::current_path(root);
+        REQUIRE(cache.find("red-tool") == (fs::path("second") / ("red-tool" + suffix)).string());
+        fs::current_path(elsewhere);
+        REQUIRE(cache.find("red-tool") == (fs::path("second") / ("red-tool" + suffix)).string());
+        fs::remove(other_tool);
+        REQUIRE_FALSE(cache.find("red-tool"));
+
+        // searched in PATH order with the indexed directories
+        sys::setenv("PATH", first.string() + environment.path_separator + "second");
+        fs::current_path(root);
+        REQUIRE(cache.find("red-tool") == in_both);
+        REQUIRE(cache.find("red-other") == (fs::path("second") / ("red-other" + suffix)).string());
+        fs::current_path(cwd);
+    }
+
+#if !defined(WIN32)
+    SECTION("non executable files are skipped")
+    {
+        make_file(first, "red-other", false);
+        REQUIRE(cache.find("red-other") == in_second);
+    }
+
+    SECTION("permission changes are seen")
+    {
+        auto const file = make_file(first, "red-perm", false);
+        REQUIRE_FALSE(cache.find("red-perm"));
+
+        fs::permissions(file, fs::perms::owner_exec, fs::perm_options::add);
+        REQUIRE(cache.find("red-perm") == file);
+
+        fs::permissions(file, fs::perms::owner_exec, fs::perm_options::remove);
+        REQUIRE_FALSE(cache.find("red-perm"));
+    }
+
+    SECTION("names with a directory are not searched")
+    {
+        REQUIRE(cache.find(in_second) == in_second);
+        REQUIRE_FALSE(cache.find("./red-other"));
+    }
+#endif
+
+    sys::setenv("PATH", old_path);
+    fs::remove_all(root);
+}
+
+TEST_CASE("option parser", "[args][options]")
+{
+    using red::session::option;
+    using red::session::option_error;
+
+    static constexpr auto parser = red::session::option_parser({
+        { 'v', "verbose" },
+        { 'q', "quiet" },
+        { 'o', "output", option::value },
+        { 'j', "jobs", option::value },
+        {  0 , "ratio", option::value },
+        { 'x', {} },
+    });
+
+    static_assert(parser.find("output") == 2);
+    static_assert(parser.find('j') == 3);
+    static_assert(parser.find("nonesuch") == parser.npos);
+    static_assert(parser.find('z') == parser.npos);
+
+    static constexpr std::array<option, 2> table = {{ { 'a', "all" }, { 'b', "bytes", option::value } }};
+    static_assert(red::session::option_parser(table).find("bytes") == 1);
+
+    std::vector<string_view> positional;
+    auto parse = [&](std::vector<string_view> args) {
+        args.insert(args.begin(), "program");
+        positional.clear();
+        return parser.parse(args, [&](string_view p) { positional.push_back(p); });
+    };
+
+    SECTION("long and short options")
+    {
+        auto opts = parse({ "--verbose", "-o", "out.txt", "--jobs=8", "file", "--ratio", "0.5" });
+        REQUIRE(opts.has("verbose"));
+        REQUIRE(opts.has('v'));
+        REQUIRE_FALSE(opts.has("quiet"));
+        REQUIRE(opts.value("output") == "out.txt");
+        REQUIRE(opts.get<int>("jobs") == 8);
+        REQUIRE(opts.get("ratio", 1.0) == 0.5);
+        REQUIRE(opts.get("quiet", true) == false);
+        REQUIRE(positional == std::vector{ "file"sv });
+    }
+
+    SECTION("bundled short options")
+    {
+        auto opts = parse({ "-vvq", "-xj4", "-oout" });
+        REQUIRE(opts.count('v') == 2);
+        REQUIRE(opts.has('q'));
+        REQUIRE(opts.has('x'));
+        REQUIRE(opts.get<int>('j') == 4);
+        REQUIRE(opts.value('o') == "out");
+    }
+
+    SECTION("the last value wins")
+    {
+        auto opts = parse({ "-j1", "--jobs", "2" });
+        REQUIRE(opts.count("jobs") == 2);
+        REQUIRE(opts.get<int>("jobs") == 2);
+    }
+
+    SECTION("-- ends the options")
+    {
+        auto opts = parse({ "-", "-v", "--", "-q", "--output" });
+        REQUIRE(opts.has("verbose"));
+        REQUIRE_FALSE(opts.has("quiet"));
+        REQUIRE(positional == std::vector{ "-"sv, "-q"sv, "--output"sv });
+    }
+
+    SECTION("values are views into the arguments")
+    {
+        std::vector<string> args = { "program", "--output=some/file", "-j", "16" };
+        auto opts = parser.parse(args);
+        REQUIRE(opts.value("output")->data() == args[1].data() + 9);
+        REQUIRE(opts.value("jobs")->data() == args[3].data());
+    }
+
+    SECTION("results outlive the parser")
+    {
+        std::vector<string_view> args = { "program", "-v", "--name", "value" };
+        auto opts = red::session::option_parser({ { 'v', "verbose" }, { 'n', "name", option::value } }).parse(args);
+
+        // overwrite the stack where the temporary parser was
+        volatile char scratch[4096];
+        for (auto& c : scratch)
+            c = 0x5a;
+
+        REQUIRE(opts.has('v'));
+        REQUIRE(opts.value("name") == "value");
+        REQUIRE(opts.get<bool>("verbose") == true);
+        REQUIRE(opts.count('n') == 1);
+    }
+
+    SECTION("parsing makes no allocations")
+    {
+        std::vector<string_view> args = { "program", "-vvq", "--output=file", "-j", "4", "--ratio", "2.5", "--", "rest" };
+        auto const allocs = count_allocations([&] {
+            int jobs = 0;
+            size_t count = 0;
+            parser.parse(args, [&](size_t i, string_view value) {
+                if (i == 3)
+                    jobs = *red::session::value_traits<int>::parse(value);
+                count++;
+            }, [](string_view) {});
+            auto opts = parser.parse(args, [](string_view) {});
+            REQUIRE(count == 6);
+            REQUIRE(jobs == 4);
+            REQUIRE(opts.get<double>("ratio") == 2.5);
+        });
+        REQUIRE(allocs == 0);
+    }
+
+    SECTION("errors")
+    {
+        REQUIRE_THROWS_AS(parse({ "--nonesuch" }), option_error);
+        REQUIRE_THROWS_AS(parse({ "-vz" }), option_error);
+        REQUIRE_THROWS_AS(parse({ "--verbose=yes" }), option_error);
+        REQUIRE_THROWS_AS(parse({ "--output" }), option_error);
+        REQUIRE_THROWS_AS(parse({ "-o" }), option_error);
+        REQUIRE_THROWS_AS(parser.parse(std::vector{ "program"sv, "positional"sv }), option_error);
+        REQUIRE_THROWS_AS(parse({ "-j", "many" }).get<int>("jobs"), option_error);
+        REQUIRE_THROWS_AS(parse({}).has("nonesuch"), std::invalid_argument);
+    }
+
+    SECTION("arguments")
+    {
+        // this test's own command line, past the '--' that ends Catch's arguments
+        static constexpr auto test_parser = red::session::option_parser({ { 'l', {}, option::value } });
+        auto const eoa = ranges::find(arguments, "--"sv);
+        std::vector<string_view> words;
+        auto opts = test_parser.parse(ranges::subrange(eoa, arguments.end()), [&](string_view w) { words.push_back(w); });
+
+        if (eoa != arguments.end()) {
+            REQUIRE(opts.get<int>('l') == 123);
+            REQUIRE(words.size() == 3);
+            REQUIRE(words[1] == "words");
+        }
+    }
 }
 
 #if 0
@@ -253,6 +1833,20 @@ TEST_CASE("Arguments", "[args]")
     }
 }
 
+#if defined(__linux__)
+TEST_CASE("arguments read from /proc/self/cmdline", "[args]")
+{
+    // what arguments falls back to when arguments::init wasn't called
+    auto const args = sys::read_cmdline();
+    REQUIRE(args.argc == static_cast<int>(cmdargs.size()));
+
+    for (int i = 0; i < args.argc; i++)
+        REQUIRE(args.storage[i] == cmdargs[i]);
+
+    REQUIRE(args.storage[args.argc] == nullptr);
+}
+#endif
+
 
 using red::session::detail::envchar;
 